@@ -0,0 +1,247 @@
+#ifndef ATSCI_ALARM_H
+#define ATSCI_ALARM_H
+
+/*
+ * Alarm rules, checked by the sampler on every reading as it comes in. A
+ * rules file has one rule per line:
+ *
+ *    <name> <probe> <parameter> <condition> [hyst=<h>] [hold=<s>]
+ *           [notify=<socket>] [exec=<command ...>]
+ *
+ * The probe is a probe label like ph:0x63 (ph:0x63@0x70:1 behind a mux),
+ * or a type like ph for all the probes of the type. The condition is
+ * "> <value>", "< <value>" or "rate> <value>", the last for a change
+ * faster than value per second either way.
+ *
+ * An alarm is raised once its condition has held for hold seconds, and
+ * cleared once the reading is back past the threshold by hyst, so a reading
+ * sitting at the threshold does not make it flap. On both the hook runs:
+ * the command given with exec (the rest of the line, run with /bin/sh
+ * without waiting for it) and a datagram to the Unix socket given with
+ * notify, both right away from the measuring thread.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+extern char **environ;
+
+enum alarm_kind { ALARM_ABOVE, ALARM_BELOW, ALARM_RATE };
+enum alarm_change { ALARM_NONE, ALARM_RAISED, ALARM_CLEARED };
+
+struct alarm_rule {
+	std::string name;
+	std::string probe;    // Label or type
+	std::string param;
+	alarm_kind kind;
+	float threshold;
+	float hyst;
+	double hold;          // Seconds
+	std::string notify;   // Unix datagram socket, empty for none
+	std::string exec;     // Shell command, empty for none
+};
+
+// A rule applied to one parameter of one probe
+struct alarm_state {
+	const alarm_rule *rule;
+	size_t param;         // Index of the value in the reading
+	bool active;
+	bool pending;         // Condition met, hold time running
+	double since;
+	bool have_last;
+	float last;
+	double last_t;
+};
+
+inline int parse_alarm_rule(const std::string &line, alarm_rule &r) {
+	std::istringstream in(line);
+	std::string op, opt;
+
+	if(!(in >> r.name >> r.probe >> r.param >> op >> r.threshold))
+		return 1;
+
+	if(op == ">") r.kind = ALARM_ABOVE;
+	else if(op == "<") r.kind = ALARM_BELOW;
+	else if(op == "rate>") r.kind = ALARM_RATE;
+	else return 1;
+
+	r.hyst = 0;
+	r.hold = 0;
+	r.notify = "";
+	r.exec = "";
+
+	while(in >> opt) {
+		char c;
+
+		if(opt.compare(0, 5, "exec=") == 0) {
+			std::string rest;
+			std::getline(in, rest);
+			r.exec = opt.substr(5) + rest;
+			break;
+		}
+
+		if(opt.compare(0, 7, "notify=") == 0) r.notify = opt.substr(7);
+		else if(sscanf(opt.c_str(), "hyst=%f%c", &r.hyst, &c) == 1 && r.hyst >= 0);
+		else if(sscanf(opt.c_str(), "hold=%lf%c", &r.hold, &c) == 1 && r.hold >= 0);
+		else return 1;
+	}
+
+	return 0;
+}
+
+// Reads the rules of a file, '#' starting a comment line
+inline int load_alarm_rules(const std::string &path, std::vector<alarm_rule> &rules) {
+	FILE *f = fopen(path.c_str(), "r");
+	if(!f) {
+		perror(path.c_str());
+		return 1;
+	}
+
+	char buf[512];
+	int status = 0;
+
+	while(fgets(buf, sizeof(buf), f)) {
+		std::string line(buf);
+		size_t start = line.find_first_not_of(" \t\r\n");
+		if(start == std::string::npos || line[start] == '#')
+			continue;
+
+		alarm_rule r;
+		if(parse_alarm_rule(line.substr(0, line.find_last_not_of("\r\n") + 1), r) != 0) {
+			std::cerr << "Invalid alarm rule: " << line;
+			status = 1;
+			break;
+		}
+
+		rules.push_back(r);
+	}
+
+	fclose(f);
+	return status;
+}
+
+inline void alarm_init(alarm_state &a, const alarm_rule *rule, size_t param) {
+	a.rule = rule;
+	a.param = param;
+	a.active = false;
+	a.pending = false;
+	a.since = 0;
+	a.have_last = false;
+	a.last = 0;
+	a.last_t = 0;
+}
+
+// Checks a reading taken at time now against the rule
+inline alarm_change alarm_update(alarm_state &a, float value, double now) {
+	const alarm_rule &r = *a.rule;
+	float level = value;
+
+	if(r.kind == ALARM_RATE) {
+		bool have_rate = a.have_last && now > a.last_t;
+		level = have_rate ? fabs(value - a.last) / (now - a.last_t) : 0;
+
+		a.have_last = true;
+		a.last = value;
+		a.last_t = now;
+
+		if(!have_rate)
+			return ALARM_NONE;
+	}
+
+	if(a.active) {
+		bool clear = (r.kind == ALARM_BELOW) ? level >= r.threshold + r.hyst : level <= r.threshold - r.hyst;
+		if(!clear)
+			return ALARM_NONE;
+
+		a.active = false;
+		return ALARM_CLEARED;
+	}
+
+	bool met = (r.kind == ALARM_BELOW) ? level < r.threshold : level > r.threshold;
+	if(!met) {
+		a.pending = false;
+		return ALARM_NONE;
+	}
+
+	if(!a.pending) {
+		a.pending = true;
+		a.since = now;
+	}
+
+	if(now - a.since < r.hold)
+		return ALARM_NONE;
+
+	a.pending = false;
+	a.active = true;
+	return ALARM_RAISED;
+}
+
+// Sends msg to a Unix datagram socket, without waiting for a slow reader;
+// returns 0 or the errno value of the failure
+inline int alarm_notify(const std::string &path, const std::string &msg) {
+	static int sock = -1;
+	if(sock < 0) {
+		sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if(sock < 0)
+			return errno;
+
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	if(sendto(sock, msg.c_str(), msg.size(), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EAGAIN)
+		return errno;
+
+	return 0;
+}
+
+/*
+ * Runs the command of a rule with the alarm in its environment as
+ * ALARM_NAME, ALARM_STATE (raised or cleared), ALARM_PROBE, ALARM_PARAM and
+ * ALARM_VALUE. The caller ignores SIGCHLD, so the child is not waited for.
+ * Returns 0 or the error number of the failure.
+ */
+inline int alarm_exec(const std::string &cmd, const std::string &name, const char *state,
+                       const std::string &probe, const std::string &param, float value) {
+	char val[32];
+	snprintf(val, sizeof(val), "%g", value);
+
+	std::vector<std::string> vars;
+	vars.push_back("ALARM_NAME=" + name);
+	vars.push_back(std::string("ALARM_STATE=") + state);
+	vars.push_back("ALARM_PROBE=" + probe);
+	vars.push_back("ALARM_PARAM=" + param);
+	vars.push_back(std::string("ALARM_VALUE=") + val);
+
+	std::vector<char *> env;
+	for(char **e = environ; *e; e++)
+		env.push_back(*e);
+	for(size_t i=0; i<vars.size(); i++)
+		env.push_back(const_cast<char *>(vars[i].c_str()));
+	env.push_back(NULL);
+
+	const char *argv[] = { "sh", "-c", cmd.c_str(), NULL };
+
+	pid_t pid;
+	return posix_spawn(&pid, "/bin/sh", NULL, NULL, const_cast<char *const *>(argv), &env[0]);
+}
+
+#endif
@@ -0,0 +1,504 @@
+#ifndef ATSCI_ASYNC_H
+#define ATSCI_ASYNC_H
+
+/*
+ * Asynchronous operations on EZO circuits, for programs with an event loop
+ * of their own. Instead of sleeping through the processing time of a
+ * command (up to a few seconds for a calibration), an operation writes the
+ * command, sets a deadline in an ezo_loop and returns. When the deadline
+ * passes, the loop reads the reply and calls the completion callback of
+ * the operation, so one thread can keep any number of circuits busy.
+ *
+ * ezo_loop is built on epoll and one timerfd armed for the earliest
+ * deadline. Its fd() can be added to another epoll set, with dispatch()
+ * called whenever it is readable; or run() drives it until nothing is
+ * pending.
+ *
+ *    ezo_loop loop;
+ *    ezo_async<ph_traits> ph(loop, "/dev/i2c-1");
+ *    ph.open();
+ *    ph.set_reg("T", 21.5, on_reply, NULL);
+ *    ph.read(names, on_reading, NULL);  // Starts after set_reg is done
+ *    loop.run();
+ *
+ * Operations on one circuit run one after another, in the order they were
+ * given. Conversions on one bus follow the interference rules of
+ * atsci_sched.h: the loop lets those of circuits that cause no interference
+ * (pH, DO) run in parallel, but one of an interfering circuit (EC) only on
+ * its own, and none start before the quiet period after the last EC
+ * conversion is over. Circuits behind different channels of a mux share
+ * the water, so they count as on one bus. Deleting an ezo_async cancels
+ * whatever it has pending in the loop.
+ *
+ * Nothing on the loop waits for the disk either. The quiet period is kept
+ * in memory only, and the state entries (cached readings, compensation
+ * values and shadow registers) are written through state_deferred(): by a
+ * file_writer thread of the loop, unless the program has deferred them
+ * elsewhere already. The entries of a bus are loaded when a circuit on it
+ * is opened.
+ */
+
+#include <map>
+#include <deque>
+#include <list>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "atsci_ezo.h"
+#include "atsci_output.h"
+#include "atsci_shadow.h"
+#include "atsci_state.h"
+
+typedef void (*ezo_timer_fn)(void *arg);
+
+// Room for state writes not written out yet
+#define EZO_LOOP_FILE_JOBS 256
+
+class ezo_loop {
+public:
+	ezo_loop() : seq_(0), writer_(NULL) {
+		quiet_persist() = false;
+
+		if(!state_deferred()) {
+			writer_ = new file_writer(EZO_LOOP_FILE_JOBS);
+			if(writer_->start() == 0) {
+				state_file_writer() = writer_;
+				state_deferred() = state_write_later;
+			}
+
+			else {
+				delete writer_;
+				writer_ = NULL;
+			}
+		}
+
+		epfd_ = epoll_create1(EPOLL_CLOEXEC);
+		tfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = tfd_;
+
+		if(epfd_ < 0 || tfd_ < 0 || epoll_ctl(epfd_, EPOLL_CTL_ADD, tfd_, &ev) != 0)
+			perror("ezo_loop");
+	}
+
+	~ezo_loop() {
+		if(tfd_ >= 0) close(tfd_);
+		if(epfd_ >= 0) close(epfd_);
+
+		// Writes out what is still queued
+		if(writer_) {
+			writer_->stop();
+			state_deferred() = NULL;
+			state_file_writer() = NULL;
+			delete writer_;
+		}
+	}
+
+	// Readable when deadlines have passed
+	int fd() const { return epfd_; }
+
+	bool pending() const { return !timers_.empty(); }
+
+	// Calls fn(arg) from dispatch() once delay seconds have passed
+	void after(double delay, ezo_timer_fn fn, void *arg) {
+		timer t = { fn, arg };
+		timers_.insert(std::make_pair(std::make_pair(now() + delay, seq_++), t));
+		arm();
+	}
+
+	// Drops the timers and gate requests for arg
+	void cancel(void *arg) {
+		for(timer_map::iterator it = timers_.begin(); it != timers_.end();) {
+			if(it->second.arg == arg) timers_.erase(it++);
+			else ++it;
+		}
+
+		for(std::map<std::string, gate>::iterator g = gates_.begin(); g != gates_.end(); ++g) {
+			for(std::list<waiter>::iterator w = g->second.waiters.begin(); w != g->second.waiters.end();) {
+				if(w->arg == arg) g->second.waiters.erase(w++);
+				else ++w;
+			}
+		}
+
+		arm();
+	}
+
+	/*
+	 * Calls fn(arg) once a conversion may start on bus: right away, or
+	 * from a later dispatch() or release(). Requests are granted in order.
+	 * An exclusive one (an interfering circuit) waits for all others to be
+	 * released, and the others wait for it. Every grant must be released.
+	 */
+	void acquire(const std::string &bus, bool exclusive, ezo_timer_fn fn, void *arg) {
+		gate &g = find_gate(bus);
+		waiter w = { exclusive, fn, arg };
+		g.waiters.push_back(w);
+		grant(g);
+	}
+
+	void release(const std::string &bus, bool exclusive) {
+		gate &g = find_gate(bus);
+		if(exclusive) g.exclusive = false;
+		else if(g.shared > 0) g.shared--;
+
+		grant(g);
+	}
+
+	// Runs the callbacks whose deadlines have passed
+	void dispatch() {
+		uint64_t expirations;
+		while(read(tfd_, &expirations, sizeof(expirations)) > 0);
+
+		// Callbacks may add timers; those wait for the next dispatch
+		// unless already due
+		double t = now();
+		while(!timers_.empty() && timers_.begin()->first.first <= t) {
+			timer due = timers_.begin()->second;
+			timers_.erase(timers_.begin());
+			due.fn(due.arg);
+		}
+
+		arm();
+	}
+
+	// Dispatches until nothing is pending
+	void run() {
+		while(pending()) {
+			struct epoll_event ev;
+			int n = epoll_wait(epfd_, &ev, 1, -1);
+			if(n < 0 && errno != EINTR) {
+				perror("epoll_wait");
+				return;
+			}
+
+			dispatch();
+		}
+	}
+
+private:
+	ezo_loop(const ezo_loop &);
+	ezo_loop &operator=(const ezo_loop &);
+
+	struct timer {
+		ezo_timer_fn fn;
+		void *arg;
+	};
+
+	typedef std::multimap<std::pair<double, unsigned long>, timer> timer_map;
+
+	struct waiter {
+		bool exclusive;
+		ezo_timer_fn fn;
+		void *arg;
+	};
+
+	// Conversions in progress on a bus node
+	struct gate {
+		ezo_loop *loop;
+		std::string bus;
+		int shared;
+		bool exclusive;
+		bool retry;          // A timer is set for the end of the quiet period
+		std::list<waiter> waiters;
+	};
+
+	gate &find_gate(const std::string &bus) {
+		std::string node = quiet_bus(bus);
+		std::map<std::string, gate>::iterator it = gates_.find(node);
+
+		if(it == gates_.end()) {
+			gate g;
+			g.loop = this;
+			g.bus = node;
+			g.shared = 0;
+			g.exclusive = false;
+			g.retry = false;
+			it = gates_.insert(std::make_pair(node, g)).first;
+		}
+
+		return it->second;
+	}
+
+	// Starts what can start on the gate, in order
+	void grant(gate &g) {
+		while(!g.waiters.empty()) {
+			waiter w = g.waiters.front();
+			if(g.exclusive || (w.exclusive && g.shared > 0))
+				return;
+
+			double left = quiet_deadline(g.bus) - state_now();
+			if(left > 0 && left < 10) {
+				if(!g.retry) {
+					g.retry = true;
+					after(left, &ezo_loop::gate_retry, &g);
+				}
+
+				return;
+			}
+
+			g.waiters.pop_front();
+			if(w.exclusive) g.exclusive = true;
+			else g.shared++;
+
+			w.fn(w.arg);
+		}
+	}
+
+	static void gate_retry(void *arg) {
+		gate *g = static_cast<gate *>(arg);
+		g->retry = false;
+		g->loop->grant(*g);
+	}
+
+	static double now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+	// Sets the timerfd to the earliest deadline
+	void arm() {
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+
+		if(!timers_.empty()) {
+			double t = timers_.begin()->first.first;
+			its.it_value.tv_sec = (time_t)t;
+			its.it_value.tv_nsec = (long)((t - its.it_value.tv_sec) * 1e9);
+
+			// Zero would disarm it
+			if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+				its.it_value.tv_nsec = 1;
+		}
+
+		timerfd_settime(tfd_, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+	int epfd_;
+	int tfd_;
+	unsigned long seq_;   // Keeps timers with the same deadline in order
+	timer_map timers_;
+	std::map<std::string, gate> gates_;  // By bus node
+	file_writer *writer_;                // Of the state entries, if the loop started it
+};
+
+template<class T>
+class ezo_async {
+public:
+	// status is 0 on success, like the return value of the driver
+	typedef void (*reply_fn)(void *arg, int status, const std::string &reply);
+	typedef void (*reading_fn)(void *arg, int status, const std::vector<float> &values);
+
+	ezo_async(ezo_loop &loop, const std::string &bus, int addr = T::addr) :
+		loop_(loop), drv_(bus, addr), busy_(false), converting_(false) {}
+
+	~ezo_async() {
+		loop_.cancel(this);
+
+		if(converting_)
+			loop_.release(drv_.bus(), T::quiet_us != 0);
+
+		for(size_t i=0; i<queue_.size(); i++)
+			delete queue_[i];
+	}
+
+	int open() {
+		state_preload(drv_.bus());
+		return drv_.open();
+	}
+
+	// For the blocking operations, when there is nothing in flight
+	ezo_driver<T> &driver() { return drv_; }
+
+	// Sends cmd and reads the reply delay_us later
+	void command(const std::string &cmd, long delay_us, reply_fn done, void *arg) {
+		op *o = new op(OP_COMMAND);
+		o->cmd = cmd;
+		o->delay_us = delay_us;
+		o->reply_done = done;
+		o->arg = arg;
+		submit(o);
+	}
+
+	// Converts and parses a value for each name, which the reading must
+	// have exactly (status 2 if it has not); they are cached under the names
+	void read(const std::vector<std::string> &names, reading_fn done, void *arg) {
+		op *o = new op(OP_READ);
+		o->names = names;
+		o->reading_done = done;
+		o->arg = arg;
+		submit(o);
+	}
+
+	// Writes a compensation or settings register, like T
+	void set_reg(const std::string &reg, float value, reply_fn done, void *arg) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%s,%.2f", reg.c_str(), value);
+
+		op *o = new op(OP_SET_REG);
+		o->cmd = buf;
+		o->reg = reg;
+		o->value = value;
+		o->delay_us = 350000; // Sleep min 300 milliseconds
+		o->reply_done = done;
+		o->arg = arg;
+		submit(o);
+	}
+
+	void set_temp(float t, reply_fn done, void *arg) {
+		set_reg("T", t, done, arg);
+	}
+
+private:
+	ezo_async(const ezo_async &);
+	ezo_async &operator=(const ezo_async &);
+
+	enum op_kind { OP_COMMAND, OP_READ, OP_SET_REG };
+
+	struct op {
+		explicit op(op_kind kind) : kind(kind), delay_us(0), value(0), reply_done(NULL),
+			reading_done(NULL), arg(NULL) {}
+
+		op_kind kind;
+		std::string cmd;
+		long delay_us;
+		std::string reg;
+		float value;
+		std::vector<std::string> names;
+		reply_fn reply_done;
+		reading_fn reading_done;
+		void *arg;
+	};
+
+	void submit(op *o) {
+		queue_.push_back(o);
+		if(!busy_)
+			next();
+	}
+
+	// Starts the operation at the front of the queue
+	void next() {
+		if(queue_.empty()) {
+			busy_ = false;
+			return;
+		}
+
+		busy_ = true;
+		op *o = queue_.front();
+
+		if(o->kind == OP_READ) {
+			// Waits for the other conversions on the bus and the quiet
+			// period, like the processing time
+			loop_.acquire(drv_.bus(), T::quiet_us != 0, &ezo_async::start_read, this);
+			return;
+		}
+
+		if(write_string(o->cmd, drv_.fd()) != 0) {
+			finish(1, "");
+			return;
+		}
+
+		loop_.after(o->delay_us / 1e6, &ezo_async::reply_ready, this);
+	}
+
+	static void start_read(void *arg) {
+		ezo_async *self = static_cast<ezo_async *>(arg);
+		self->converting_ = true;
+
+		if(self->drv_.send_read() != 0) {
+			self->end_conversion();
+			self->finish_reading(1, std::vector<float>());
+		}
+
+		else self->loop_.after(T::conv_us / 1e6, &ezo_async::reading_ready, self);
+	}
+
+	static void reading_ready(void *arg) {
+		ezo_async *self = static_cast<ezo_async *>(arg);
+		const std::vector<std::string> &names = self->queue_.front()->names;
+		std::vector<float> values(names.size());
+
+		// An EC fetch starts the quiet period, which the gate waits out
+		int status = names.empty() ? 2 : self->drv_.fetch_values(&values[0], values.size());
+		self->end_conversion();
+
+		if(status == 0) {
+			std::string comp = self->drv_.comp_signature();
+			for(size_t i=0; i<names.size(); i++)
+				cache_store(self->drv_.bus(), self->drv_.addr(), names[i], comp, values[i]);
+		}
+
+		else values.clear();
+
+		self->finish_reading(status, values);
+	}
+
+	void end_conversion() {
+		converting_ = false;
+		loop_.release(drv_.bus(), T::quiet_us != 0);
+	}
+
+	static void reply_ready(void *arg) {
+		ezo_async *self = static_cast<ezo_async *>(arg);
+		op *o = self->queue_.front();
+
+		std::string result;
+		int status = self->drv_.reply(result);
+
+		if(o->kind == OP_SET_REG) {
+			if(status == 0) {
+				comp_store(self->drv_.bus(), self->drv_.addr(), o->reg, o->value);
+				shadow_note(self->drv_.bus(), self->drv_.addr(), o->reg, o->value);
+			}
+
+			else shadow_invalidate(self->drv_.bus(), self->drv_.addr());
+		}
+
+		self->finish(status, result);
+	}
+
+	// Completes the front operation and starts the next one. The next one
+	// is started first, so a callback can give new operations right away.
+	void finish(int status, const std::string &result) {
+		op *o = queue_.front();
+		queue_.pop_front();
+		next();
+
+		if(o->reply_done)
+			o->reply_done(o->arg, status, result);
+
+		delete o;
+	}
+
+	void finish_reading(int status, const std::vector<float> &values) {
+		op *o = queue_.front();
+		queue_.pop_front();
+		next();
+
+		if(o->reading_done)
+			o->reading_done(o->arg, status, values);
+
+		delete o;
+	}
+
+	ezo_loop &loop_;
+	ezo_driver<T> drv_;
+	bool busy_;
+	bool converting_;  // Holds the bus gate of the loop
+	std::deque<op *> queue_;
+};
+
+#endif
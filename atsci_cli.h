@@ -0,0 +1,735 @@
+#ifndef ATSCI_CLI_H
+#define ATSCI_CLI_H
+
+/*
+ * The command line tool for an EZO circuit, generated from its traits:
+ *
+ *   int main(int argc, char **argv) { return ezo_main<ph_traits>(argc, argv); }
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+
+#include "atsci_ezo.h"
+#include "atsci_fleet.h"
+#include "atsci_rtd.h"
+#include "atsci_shadow.h"
+#include "atsci_state.h"
+#include "atsci_traits.h"
+
+template<class T>
+void ezo_usage() {
+	std::cout <<	"Atlas Scientific EZO class " << T::title() << " sensor I2C driver\n"
+			"Author: Jaakko Salo (jaakkos@gmail.com)\n"
+			"\n"
+			"Usage: atsci_" << T::name() << " [-a <address>] <device> <operation> [arguments ...]\n"
+			"\n"
+			"Device is the Linux device node, like /dev/i2c-2. For a circuit behind\n"
+			"an I2C multiplexer, append the mux address and channel: /dev/i2c-2@0x70:3\n"
+			"For a circuit in UART mode, use uart:<tty>[:<baud>], like uart:/dev/ttyUSB0.\n"
+			"The circuit is expected at its default I2C address unless given with -a.\n"
+			"Supported operations:\n"
+			"\n"
+		<< T::usage() <<
+			"\n"
+			"Set operations skip the bus write when the value is the one last set\n"
+			"through the tools and the circuit has not restarted since. Append\n"
+			"--tolerance <d> to also skip it when the value is within d of that, or\n"
+			"--tolerance -1 to always write.\n"
+			"\n"
+			"Append --timestamps to a read operation to get a second line:\n"
+			"\n"
+			"   time <R mono> <R real> <reply mono> <reply real> <mid mono> <mid real>\n"
+			"\n"
+			"with the CLOCK_MONOTONIC and CLOCK_REALTIME times in seconds at which\n"
+			"the R command was sent, the reading was read back, and the middle of\n"
+			"that window. For an average the window runs from the first R command\n"
+			"to the last reading. A reading from the cache has no time line.\n"
+			"\n"
+			"More than one circuit of a type on a bus need addresses of their own:\n"
+			"\n"
+			"   addr set <address> Move the circuit to another I2C address, and check\n"
+			"                      that it answers there\n"
+			"   addr fleet <file> [count]\n"
+			"                      Give each circuit connected in turn at the address\n"
+			"                      the next free one, and add it to file as a probe\n"
+			"                      for atsci_sampler -f\n"
+			"\n"
+			"A circuit in UART mode (or a recording of one) can also stream its\n"
+			"readings, about one a second, until count readings (if given) or SIGINT:\n"
+			"\n"
+			"   stream [count]     Print each reading of continuous mode (C,1)\n"
+			"\n"
+			"Any calibration can be run as 'cal auto', like 'cal auto mid 7.00': the\n"
+			"probe is read continuously, and the calibration is done as soon as the\n"
+			"standard deviation of the last readings shows it has settled in the\n"
+			"solution. Options (after the calibration arguments):\n"
+			"\n"
+			"   --window <n>       Number of readings to look at (default 10)\n"
+			"   --stddev <d>       Settled when the deviation is at most d\n"
+			"   --timeout <s>      Give up after s seconds (default 600)\n"
+			"\n";
+
+	exit(1);
+}
+
+inline int parse_count(const std::vector<std::string> &args, int *count) {
+	if(sscanf(args[3].c_str(), "%d", count) != 1) {
+		std::cout << "Invalid argument." << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Pops a trailing "--timestamps"; true if it was there
+inline bool parse_timestamps(std::vector<std::string> &args) {
+	if(args.size() <= 3 || args.back() != "--timestamps")
+		return false;
+
+	args.pop_back();
+	return true;
+}
+
+template<class T>
+std::vector<std::string> ezo_params() {
+	std::vector<std::string> names;
+	for(const char *const *p = T::params(); *p; p++)
+		names.push_back(*p);
+
+	return names;
+}
+
+template<class T>
+int cli_read(std::vector<std::string> &args, ezo_driver<T> &drv, const ezo_read_op &op) {
+	double max_age = -1;
+	bool timestamps = parse_timestamps(args);
+
+	if(args.size() != 3 && parse_max_age(args, 3, &max_age) != 0) ezo_usage<T>();
+
+	std::vector<std::string> names = ezo_params<T>();
+	float value;
+
+	if(max_age >= 0 && cache_lookup(drv.bus(), drv.addr(), names[op.param], drv.comp_signature(),
+	                                max_age, &value) == 0) {
+		printf(T::print_format(), value);
+		return 0;
+	}
+
+	std::vector<float> values;
+	if(drv.check_format() != 0 || drv.measure(names, values) != 0)
+		return 1;
+
+	printf(T::print_format(), values[op.param]);
+
+	if(timestamps)
+		print_window("", drv.window());
+
+	return 0;
+}
+
+template<class T>
+int cli_read_avg(std::vector<std::string> &args, ezo_driver<T> &drv, const ezo_read_op &op) {
+	bool timestamps = parse_timestamps(args);
+	if(args.size() != 4) ezo_usage<T>();
+
+	int count;
+	if(parse_count(args, &count) != 0)
+		return 1;
+
+	if(drv.check_format() != 0)
+		return 1;
+
+	std::vector<std::string> names = ezo_params<T>();
+	float avg = 0.0;
+	sample_window window;
+
+	for(int i=0; i<count; i++) {
+		std::vector<float> values;
+
+		if(drv.measure(names, values) != 0)
+			return 1;
+
+		if(i == 0) window.start = drv.window().start;
+		window.reply = drv.window().reply;
+
+		avg += values[op.param];
+	}
+
+	printf("%.3f\n", avg/count);
+
+	if(timestamps && count > 0)
+		print_window("", window);
+
+	return 0;
+}
+
+// Every enabled parameter from a single conversion, "<name> <value>" lines
+template<class T>
+int cli_read_all(std::vector<std::string> &args, ezo_driver<T> &drv) {
+	bool timestamps = parse_timestamps(args);
+	bool avg = (args[2] == "read_avg_all");
+	if(args.size() != (avg ? 4u : 3u)) ezo_usage<T>();
+
+	int count = 1;
+	if(avg && parse_count(args, &count) != 0)
+		return 1;
+
+	// Devices with optional outputs report what is enabled instead
+	if(!T::output_order() && drv.check_format() != 0)
+		return 1;
+
+	std::vector<std::string> names;
+	if(drv.outputs(names) != 0)
+		return 1;
+
+	std::vector<float> sum(names.size(), 0.0);
+	sample_window window;
+
+	for(int i=0; i<count; i++) {
+		std::vector<float> values;
+
+		if(drv.measure(names, values) != 0)
+			return 1;
+
+		if(i == 0) window.start = drv.window().start;
+		window.reply = drv.window().reply;
+
+		for(size_t j=0; j<names.size(); j++)
+			sum[j] += values[j];
+	}
+
+	for(size_t i=0; i<names.size(); i++) {
+		if(avg) printf("%s %.3f\n", names[i].c_str(), sum[i]/count);
+		else std::cout << names[i] << " " << sum[i] << std::endl;
+	}
+
+	if(timestamps && count > 0) {
+		std::cout << std::flush;
+		print_window("", window);
+	}
+
+	return 0;
+}
+
+template<class T>
+int cli_info(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() != 3) ezo_usage<T>();
+
+	std::string info;
+	if(drv.info(info) != 0)
+		return 1;
+
+	std::cout << "Device info string: " << info << std::endl;
+	return 0;
+}
+
+template<class T>
+int cli_status(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() != 3) ezo_usage<T>();
+
+	char reason;
+	float vcc;
+	if(drv.status(&reason, &vcc) != 0)
+		return 1;
+
+	std::string sreason;
+	switch(reason) {
+		case 'P': sreason = "power on reset"; break;
+		case 'S': sreason = "software reset"; break;
+		case 'B': sreason = "brown out reset"; break;
+		case 'W': sreason = "watchdog reset"; break;
+		default: sreason = "unknown";
+	}
+
+	std::cout << "Last restart reason: " << sreason << ", voltage at VCC pin: " << vcc << std::endl;
+	return 0;
+}
+
+template<class T>
+int cli_reg(const std::vector<std::string> &args, ezo_driver<T> &drv, const ezo_reg &reg) {
+	if(args.size() < 4) ezo_usage<T>();
+
+	if(args[3] == "get") {
+		if(args.size() != 4) ezo_usage<T>();
+
+		float value;
+		if(drv.get_reg(reg.cmd, &value) != 0)
+			return 1;
+
+		std::cout << value << std::endl;
+		return 0;
+	}
+
+	if(args[3] != "set") ezo_usage<T>();
+
+	float tol = 0;
+	if(args.size() != 5 && parse_tolerance(args, 5, &tol) != 0) ezo_usage<T>();
+
+	float value;
+	bool is_rtd = (std::string(reg.cmd) == "T" && args[4].compare(0, 3, "rtd") == 0);
+
+	if(std::string(reg.cmd) == "T") {
+		if(temp_from_arg(drv.bus(), args[4], 0, &value) != 0)
+			return 1;
+	}
+
+	else if(sscanf(args[4].c_str(), "%f", &value) != 1) {
+		std::cout << "Invalid floating point as " << reg.op << ": " << args[4] << std::endl;
+		return 1;
+	}
+
+	return drv.set_reg(reg.cmd, value, tol, is_rtd ? "" : args[4]);
+}
+
+template<class T>
+int cli_led(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() < 4) ezo_usage<T>();
+
+	if(args[3] == "get") {
+		if(args.size() != 4) ezo_usage<T>();
+
+		bool on;
+		if(drv.get_led(&on) != 0)
+			return 1;
+
+		std::cout << (on ? "on" : "off") << std::endl;
+		return 0;
+	}
+
+	if(args[3] != "set") ezo_usage<T>();
+
+	float tol = 0;
+	if(args.size() != 5 && parse_tolerance(args, 5, &tol) != 0) ezo_usage<T>();
+
+	if(args[4] != "on" && args[4] != "off") {
+		std::cout << "State must be on or off." << std::endl;
+		return 1;
+	}
+
+	return drv.set_led(args[4] == "on", tol);
+}
+
+/*
+ * Finds the calibration sub-command named by args[pos], or else the one
+ * without a name, which takes its value right at args[pos]. Returns the
+ * index of the first argument after the sub-command in *end.
+ */
+template<class T>
+const ezo_cal_op &find_cal_op(const std::vector<std::string> &args, size_t pos, size_t *end) {
+	const ezo_cal_op *op = T::cal_ops();
+	size_t value_arg = pos + 1;
+
+	while(op->op && args[pos] != op->op)
+		op++;
+
+	if(!op->op) {
+		for(op = T::cal_ops(); op->op && *op->op; op++);
+		value_arg = pos;
+	}
+
+	if(!op->op) ezo_usage<T>();
+	if(op->fmt && args.size() <= value_arg) ezo_usage<T>();
+
+	*end = op->fmt ? value_arg + 1 : value_arg;
+	return *op;
+}
+
+inline int parse_cal_value(const ezo_cal_op &op, const std::string &arg, float *value) {
+	*value = 0;
+	if(op.fmt && sscanf(arg.c_str(), "%f", value) != 1) {
+		std::cout << "Invalid floating point as calibration value." << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Calibrates as soon as the readings have settled
+template<class T>
+int cli_cal_auto(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() < 5) ezo_usage<T>();
+
+	size_t end;
+	const ezo_cal_op &op = find_cal_op<T>(args, 4, &end);
+
+	float value;
+	if(parse_cal_value(op, args[end - 1], &value) != 0)
+		return 1;
+
+	int window = 10;
+	double max_stddev = -1;
+	double timeout = 600;
+
+	for(size_t i=end; i<args.size(); i+=2) {
+		if(i + 1 >= args.size()) ezo_usage<T>();
+
+		const char *arg = args[i+1].c_str();
+
+		if(args[i] == "--window") {
+			if(sscanf(arg, "%d", &window) != 1 || window < 2) ezo_usage<T>();
+		}
+
+		else if(args[i] == "--stddev") {
+			if(sscanf(arg, "%lf", &max_stddev) != 1 || max_stddev < 0) ezo_usage<T>();
+		}
+
+		else if(args[i] == "--timeout") {
+			if(sscanf(arg, "%lf", &timeout) != 1 || timeout <= 0) ezo_usage<T>();
+		}
+
+		else ezo_usage<T>();
+	}
+
+	if(drv.check_format() != 0)
+		return 1;
+
+	std::vector<std::string> names = ezo_params<T>();
+	std::deque<float> recent;
+	double deadline = state_now() + timeout;
+
+	// Back to back conversions are the fastest safe rate; the quiet period
+	// of an EC measurement is still waited for
+	for(int n=1; state_now() < deadline; n++) {
+		std::vector<float> values;
+		if(drv.measure(names, values) != 0)
+			return 1;
+
+		recent.push_back(values[0]);
+		if(recent.size() > (size_t)window)
+			recent.pop_front();
+
+		if(recent.size() < (size_t)window) {
+			std::cout << values[0] << std::endl;
+			continue;
+		}
+
+		double mean = 0, var = 0;
+		for(size_t i=0; i<recent.size(); i++)
+			mean += recent[i];
+		mean /= recent.size();
+
+		for(size_t i=0; i<recent.size(); i++)
+			var += (recent[i] - mean) * (recent[i] - mean);
+
+		double stddev = sqrt(var / (recent.size() - 1));
+		std::cout << values[0] << " " << stddev << std::endl;
+
+		if(stddev <= (max_stddev >= 0 ? max_stddev : T::cal_stddev(mean))) {
+			std::cout << "Settled after " << n << " readings, calibrating." << std::endl;
+			return drv.cal(op, value);
+		}
+	}
+
+	std::cout << "Readings did not settle in " << timeout << " seconds." << std::endl;
+	return 1;
+}
+
+template<class T>
+int cli_cal(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() < 4) ezo_usage<T>();
+
+	if(args[3] == "get") {
+		if(args.size() != 4) ezo_usage<T>();
+
+		int points;
+		if(drv.cal_status(&points) != 0)
+			return 1;
+
+		switch(points) {
+			case 0: std::cout << "Not calibrated." << std::endl; break;
+			case 1: std::cout << "Single-point calibrated." << std::endl; break;
+			case 2: std::cout << "Two-point calibrated." << std::endl; break;
+			case 3: std::cout << "Three-point calibrated." << std::endl; break;
+			default: std::cout << "Unknown calibration status." << std::endl; break;
+		}
+
+		return 0;
+	}
+
+	if(args[3] == "clear") {
+		if(args.size() != 4) ezo_usage<T>();
+		return drv.cal_clear();
+	}
+
+	if(args[3] == "auto")
+		return cli_cal_auto(args, drv);
+
+	size_t end;
+	const ezo_cal_op &op = find_cal_op<T>(args, 3, &end);
+	if(args.size() != end) ezo_usage<T>();
+
+	float value;
+	if(parse_cal_value(op, args[end - 1], &value) != 0)
+		return 1;
+
+	return drv.cal(op, value);
+}
+
+// Whether something answers at addr, probed with a one byte read like
+// i2cdetect -r does
+inline bool addr_in_use(const std::string &bus, int addr) {
+	int dev = bus_open(bus, addr);
+	if(dev < 0)
+		return errno == EBUSY;  // Claimed by a kernel driver
+
+	char byte;
+	bool used = (bus_read(dev, &byte, 1) == 1);
+	close(dev);
+	return used;
+}
+
+// Checks that a circuit of type T answers at addr; info gets its info string
+template<class T>
+int verify_circuit(const std::string &bus, int addr, std::string &info) {
+	ezo_driver<T> drv(bus, addr);
+	if(drv.open() != 0 || drv.info(info) != 0)
+		return 1;
+
+	std::string type = info.substr(0, info.find(','));
+	if(strcasecmp(type.c_str(), T::name()) != 0) {
+		std::cout << "Found " << type << " instead of " << T::title() << " at 0x" << std::hex << addr
+		          << std::dec << "." << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Moves the circuit from drv's address to addr, verifying it there
+template<class T>
+int move_circuit(ezo_driver<T> &drv, int addr) {
+	if(addr_in_use(drv.bus(), addr)) {
+		printf("Address 0x%02x is already in use.\n", addr);
+		return 1;
+	}
+
+	if(drv.set_address(addr) != 0)
+		return 1;
+
+	usleep(2000000); // The circuit restarts at the new address
+
+	// What was remembered about either address is no longer true
+	shadow_invalidate(drv.bus(), drv.addr());
+	shadow_invalidate(drv.bus(), addr);
+
+	std::string info;
+	if(verify_circuit<T>(drv.bus(), addr, info) != 0) {
+		printf("The circuit did not answer at 0x%02x.\n", addr);
+		return 1;
+	}
+
+	printf("Moved from 0x%02x to 0x%02x: %s\n", drv.addr(), addr, info.c_str());
+	return 0;
+}
+
+inline int parse_addr(const std::string &arg, int *addr) {
+	if(sscanf(arg.c_str(), "%i", addr) != 1 || *addr < 0x08 || *addr > 0x77) {
+		std::cout << "Invalid I2C address (0x08 to 0x77): " << arg << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+template<class T>
+int cli_addr_fleet(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() != 5 && args.size() != 6) ezo_usage<T>();
+
+	const std::string &path = args[4];
+	int count = -1;
+	if(args.size() == 6 && sscanf(args[5].c_str(), "%d", &count) != 1) ezo_usage<T>();
+
+	for(int n=0; count < 0 || n < count; n++) {
+		std::cout << "Connect the next " << T::title() << " circuit at 0x" << std::hex << drv.addr()
+		          << std::dec << " (only one at a time)." << std::endl;
+
+		while(!addr_in_use(drv.bus(), drv.addr()))
+			usleep(1000000);
+
+		std::string info;
+		if(verify_circuit<T>(drv.bus(), drv.addr(), info) != 0)
+			return 1;
+
+		// The lowest address not on the bus nor in the fleet, which is
+		// empty until the file exists
+		std::vector<std::string> fleet;
+		std::vector<probe_place> taken;
+		fleet_load(path, fleet);
+		fleet_places(fleet, taken);
+
+		// The probes go in the file behind the channel of the bus, if any
+		size_t at = drv.bus().rfind('@');
+		std::string route = (at == std::string::npos) ? "" : drv.bus().substr(at);
+
+		int addr = 0x08;
+		while(addr <= 0x77 && (addr == drv.addr() || fleet_taken(taken, route, addr) || addr_in_use(drv.bus(), addr)))
+			addr++;
+
+		if(addr > 0x77) {
+			std::cout << "No free I2C addresses left." << std::endl;
+			return 1;
+		}
+
+		if(move_circuit(drv, addr) != 0)
+			return 1;
+
+		char probe[64];
+		snprintf(probe, sizeof(probe), "%s:0x%02x%s", T::name(), addr, route.c_str());
+		if(fleet_append(path, probe) != 0)
+			return 1;
+
+		std::cout << "Added " << probe << " to " << path << "." << std::endl;
+	}
+
+	return 0;
+}
+
+template<class T>
+int cli_addr(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() < 4) ezo_usage<T>();
+
+	if(args[3] == "fleet")
+		return cli_addr_fleet(args, drv);
+
+	if(args[3] != "set" || args.size() != 5) ezo_usage<T>();
+
+	int addr;
+	if(parse_addr(args[4], &addr) != 0)
+		return 1;
+
+	if(addr == drv.addr()) {
+		std::cout << "The circuit is already at that address." << std::endl;
+		return 0;
+	}
+
+	return move_circuit(drv, addr);
+}
+
+inline volatile sig_atomic_t &stream_stop() {
+	static volatile sig_atomic_t stop = 0;
+	return stop;
+}
+
+inline void stream_stop_handler(int) {
+	stream_stop() = 1;
+}
+
+// Readings of continuous mode, without a command per reading
+template<class T>
+int cli_stream(std::vector<std::string> &args, ezo_driver<T> &drv) {
+	bool timestamps = parse_timestamps(args);
+
+	if(args.size() > 4) ezo_usage<T>();
+
+	int count = -1;
+	if(args.size() == 4 && parse_count(args, &count) != 0)
+		return 1;
+
+	if(args[1].compare(0, 5, "uart:") != 0 && args[1].compare(0, 7, "replay:") != 0) {
+		std::cout << "Streaming needs a circuit in UART mode (uart:<tty>)." << std::endl;
+		return 1;
+	}
+
+	if(drv.check_format() != 0)
+		return 1;
+
+	std::vector<std::string> names;
+	if(drv.outputs(names) != 0)
+		return 1;
+
+	signal(SIGINT, stream_stop_handler);
+	signal(SIGTERM, stream_stop_handler);
+
+	if(drv.set_continuous(true) != 0)
+		return 1;
+
+	int status = 0;
+
+	for(int n=0; (count < 0 || n < count) && !stream_stop(); n++) {
+		std::vector<float> values;
+
+		// Continuous mode reports once a second
+		if(drv.next_reading(names, values, 3000) != 0) {
+			if(stream_stop())
+				break;
+
+			std::cout << "No reading from the circuit in continuous mode." << std::endl;
+			status = 1;
+			break;
+		}
+
+		if(names.size() == 1) printf(T::print_format(), values[0]);
+		else for(size_t i=0; i<names.size(); i++)
+			printf("%s %g\n", names[i].c_str(), values[i]);
+
+		if(timestamps)
+			print_window("", drv.window());
+
+		fflush(stdout);
+	}
+
+	if(drv.set_continuous(false) != 0)
+		return 1;
+
+	return status;
+}
+
+template<class T>
+int cli_sleep(const std::vector<std::string> &args, ezo_driver<T> &drv) {
+	if(args.size() != 3) ezo_usage<T>();
+	return drv.sleep();
+}
+
+template<class T>
+int ezo_main(int argc, char **argv) {
+	std::vector<std::string> args(argv, argv+argc);
+
+	int addr = T::addr;
+	if(args.size() > 2 && args[1] == "-a") {
+		if(parse_addr(args[2], &addr) != 0)
+			return 1;
+
+		args.erase(args.begin() + 1, args.begin() + 3);
+	}
+
+	if(args.size() < 3) ezo_usage<T>();
+
+	ezo_driver<T> drv(args[1], addr);
+	if(drv.open() != 0) return 1;
+
+	for(const ezo_read_op *op = T::read_ops(); op->op; op++) {
+		if(args[2] != op->op)
+			continue;
+
+		return op->avg ? cli_read_avg(args, drv, *op) : cli_read(args, drv, *op);
+	}
+
+	for(const ezo_reg *reg = T::regs(); reg->op; reg++)
+		if(args[2] == reg->op)
+			return cli_reg(args, drv, *reg);
+
+	if(T::has_read_all && (args[2] == "read_all" || args[2] == "read_avg_all"))
+		return cli_read_all(args, drv);
+
+	else if(args[2] == "info") return cli_info(args, drv);
+	else if(args[2] == "status") return cli_status(args, drv);
+	else if(args[2] == "led") return cli_led(args, drv);
+	else if(args[2] == "cal") return cli_cal(args, drv);
+	else if(args[2] == "sleep") return cli_sleep(args, drv);
+	else if(args[2] == "stream") return cli_stream(args, drv);
+	else if(args[2] == "addr") return cli_addr(args, drv);
+	else ezo_usage<T>();
+
+	return 1;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef ATSCI_DUTY_H
+#define ATSCI_DUTY_H
+
+/*
+ * Duty cycling for battery powered sites. The sampler puts a circuit to
+ * sleep right after its last transaction of the cycle and wakes it ahead of
+ * its next conversion. How long a circuit takes from the wake-up command
+ * until it is awake, seen as it starts processing the command, is learned
+ * per circuit, the way TCP learns a round trip time: a smoothed latency and
+ * its mean deviation, with the circuit woken the smoothed latency plus four
+ * deviations ahead. A circuit that wakes fast is left asleep longer, and
+ * one that is late now and then gets more lead. The processing time of the
+ * wake-up command itself is the same every time, so it is added to the
+ * lead rather than learned.
+ */
+
+// Lead before the first measurement of a circuit's wake-up
+#define DUTY_LEAD_INITIAL_S 1.0
+
+// The wake-up command is given up on after this long
+#define DUTY_WAKE_TIMEOUT_S 5.0
+
+// Time between polls of a waking circuit
+#define DUTY_POLL_US 10000
+
+// Processing time of the wake-up command (I) once the circuit is awake
+#define DUTY_WAKE_CMD_S 0.3
+
+struct wake_latency {
+	int samples;
+	double smoothed;   // Seconds
+	double deviation;
+};
+
+inline void wake_init(wake_latency &w) {
+	w.samples = 0;
+	w.smoothed = 0;
+	w.deviation = 0;
+}
+
+inline void wake_learn(wake_latency &w, double latency) {
+	if(w.samples++ == 0) {
+		w.smoothed = latency;
+		w.deviation = latency / 2;
+		return;
+	}
+
+	double err = latency - w.smoothed;
+	w.smoothed += err / 8;
+	w.deviation += ((err < 0 ? -err : err) - w.deviation) / 4;
+}
+
+// How long before its conversion a sleeping circuit should be woken
+inline double wake_lead(const wake_latency &w) {
+	if(w.samples == 0)
+		return DUTY_LEAD_INITIAL_S;
+
+	// Plus a poll, since readiness is only seen at the next one
+	return w.smoothed + 4 * w.deviation + DUTY_WAKE_CMD_S + DUTY_POLL_US / 1e6;
+}
+
+#endif
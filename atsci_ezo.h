@@ -0,0 +1,409 @@
+#ifndef ATSCI_EZO_H
+#define ATSCI_EZO_H
+
+/*
+ * Driver for an EZO circuit of the type described by the traits T (see
+ * atsci_traits.h). All the per-type constants come from T at compile time;
+ * the driver itself is the transaction code that used to be copied into
+ * every tool. Code that picks the type at run time, like the sampler, uses
+ * the drivers through their ezo_device base.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "atsci_i2c.h"
+#include "atsci_shadow.h"
+#include "atsci_state.h"
+#include "atsci_time.h"
+#include "atsci_traits.h"
+
+/*
+ * The operations of ezo_driver<T> for a type known only at run time, like
+ * the probes of the sampler. A call through here costs an indirect jump of
+ * a few nanoseconds, against the write() or read() on the bus it leads to
+ * and the conversion or command time of the circuit, 300 ms to over a
+ * second; the parsing and the rest of the work inside are still the
+ * inlined code of ezo_driver<T>.
+ */
+class ezo_device {
+public:
+	virtual ~ezo_device() {}
+
+	virtual int open() = 0;
+	virtual void close() = 0;
+	virtual const std::string &bus() const = 0;
+	virtual int addr() const = 0;
+	virtual int fd() const = 0;
+	virtual int check_format() = 0;
+	virtual int send_read() = 0;
+	virtual int fetch_values(float *values, size_t count) = 0;
+	virtual void cache_values(const float *values, size_t count) = 0;
+	virtual const sample_window &window() const = 0;
+	virtual int set_reg(const std::string &cmd, float value, float tol, const std::string &str = "") = 0;
+	virtual int status(char *reason, float *vcc) = 0;
+	virtual int send_status() = 0;
+	virtual int read_status(char *reason, float *vcc) = 0;
+	virtual int sleep() = 0;
+};
+
+template<class T>
+class ezo_driver : public ezo_device {
+public:
+	ezo_driver(const std::string &bus, int addr = T::addr) : bus_(bus), addr_(addr), dev_(-1) {}
+
+	~ezo_driver() {
+		close();
+	}
+
+	int open() {
+		dev_ = open_dev(bus_, addr_);
+		return dev_ < 0;
+	}
+
+	void close() {
+		if(dev_ >= 0) ::close(dev_);
+		dev_ = -1;
+	}
+
+	const std::string &bus() const { return bus_; }
+	int addr() const { return addr_; }
+	int fd() const { return dev_; }
+
+	// Sends cmd, waits delay_us for the circuit to process it and reads
+	// the reply
+	int command(const std::string &cmd, long delay_us, std::string &result) {
+		if(write_string(cmd, dev_) != 0)
+			return 1;
+
+		usleep(delay_us);
+
+		return reply(result);
+	}
+
+	// The reply to the last command, once it has been processed
+	int reply(std::string &result) {
+		return read_string(result, dev_, T::bufsize);
+	}
+
+	int check_format() {
+		return T::check_format(dev_);
+	}
+
+	// The compensation values the readings currently depend on
+	std::string comp_signature() {
+		std::vector<const char *> names;
+		for(const ezo_reg *r = T::regs(); r->op; r++)
+			names.push_back(r->cmd);
+
+		if(names.empty())
+			return "-";
+
+		names.push_back(NULL);
+		return ::comp_signature(bus_, addr_, &names[0]);
+	}
+
+	// Starts a conversion. The reading is available T::conv_us later.
+	int start() {
+		quiet_wait(bus_);
+		return send_read();
+	}
+
+	// start() without waiting for the quiet period, for callers that
+	// wait for quiet_deadline() some other way
+	int send_read() {
+		if(write_string("R", dev_) != 0)
+			return 1;
+
+		clock_pair_now(window_.start);
+		return 0;
+	}
+
+	// Timestamps of the last conversion fetched
+	const sample_window &window() const { return window_; }
+
+	// Fetches the reading of a conversion started with start(), parsing
+	// as many values as there are names
+	int fetch(const std::vector<std::string> &names, std::vector<float> &values) {
+		// Let other measurements sleep out the electrical interference
+		// caused by this one, instead of blocking here until it is over
+		if(T::quiet_us != 0)
+			quiet_mark(bus_, T::quiet_us / 1e6);
+
+		std::string result;
+		if(read_string(result, dev_, T::bufsize) != 0)
+			return 1;
+
+		clock_pair_now(window_.reply);
+		return parse(result, names, values);
+	}
+
+	// Like fetch(), into count values and without caching them (see
+	// cache_values()). The reading must have exactly that many; returns 2
+	// if it has not. The reply is read into a buffer of the driver, so
+	// unless something fails, nothing is allocated.
+	int fetch_values(float *values, size_t count) {
+		if(T::quiet_us != 0)
+			quiet_mark(bus_, T::quiet_us / 1e6);
+
+		if(read_reply(dev_, reply_, T::bufsize) != 0)
+			return 1;
+
+		clock_pair_now(window_.reply);
+
+		const char *pos = reply_;
+		for(size_t i=0; i<count; i++) {
+			char *end;
+			values[i] = strtof(pos, &end);
+
+			if(end == pos || *end != ((i + 1 < count) ? ',' : '\0')) {
+				diag() << "Unexpected reading from device: " << reply_ << std::endl;
+				return 2;
+			}
+
+			pos = end + 1;
+		}
+
+		return 0;
+	}
+
+	// Stores count values fetched with fetch_values() in the result cache,
+	// under the parameter names of the type
+	void cache_values(const float *values, size_t count) {
+		std::string comp = comp_signature();
+		for(size_t i=0; i<count && T::params()[i]; i++)
+			cache_store(bus_, addr_, T::params()[i], comp, values[i]);
+	}
+
+	int measure(const std::vector<std::string> &names, std::vector<float> &values) {
+		if(start() != 0)
+			return 1;
+
+		usleep(T::conv_us);
+
+		return fetch(names, values);
+	}
+
+	// Turns continuous mode of a circuit in UART mode on or off
+	int set_continuous(bool on) {
+		std::string result;
+		return command(on ? "C,1" : "C,0", 350000, result);
+	}
+
+	// Waits at most timeout_ms for the next reading of continuous mode
+	int next_reading(const std::vector<std::string> &names, std::vector<float> &values, int timeout_ms) {
+		std::string line;
+		if(uart_line(dev_, line, timeout_ms) != 0)
+			return 1;
+
+		// There is no R command; the window is the moment it arrived
+		clock_pair_now(window_.reply);
+		window_.start = window_.reply;
+
+		return parse(line, names, values);
+	}
+
+	// The output parameters enabled in the reading string
+	int outputs(std::vector<std::string> &names) {
+		if(T::output_order())
+			return query_outputs(dev_, T::output_order(), names, T::bufsize);
+
+		names.clear();
+		for(const char *const *p = T::params(); *p; p++)
+			names.push_back(*p);
+
+		return 0;
+	}
+
+	// Writes a settings register, unless the shadow says the circuit
+	// already has the value. str is what gets sent, if not value itself.
+	int set_reg(const std::string &cmd, float value, float tol, const std::string &str = "") {
+		if(shadow_skip(dev_, bus_, addr_, cmd, value, tol, T::bufsize))
+			return 0;
+
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.2f", value);
+
+		std::string result;
+		if(command(cmd + "," + (str.empty() ? buf : str), 350000, result) != 0) {
+			shadow_invalidate(bus_, addr_);
+			return 1;
+		}
+
+		comp_store(bus_, addr_, cmd, value);
+		shadow_store(dev_, bus_, addr_, cmd, value, T::bufsize);
+		return 0;
+	}
+
+	int get_reg(const std::string &cmd, float *value) {
+		std::string result;
+		if(command(cmd + ",?", 350000, result) != 0)
+			return 1;
+
+		// The reply is like "?T,25.0"
+		if((result.length() < cmd.size() + 2) || (sscanf(result.c_str() + cmd.size() + 2, "%f", value) != 1)) {
+			diag() << "Invalid floating point from device: " << result << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	int set_led(bool on, float tol) {
+		if(shadow_skip(dev_, bus_, addr_, "L", on, tol, T::bufsize))
+			return 0;
+
+		std::string result;
+		if(command(on ? "L,1" : "L,0", 350000, result) != 0)
+			return 1;
+
+		shadow_store(dev_, bus_, addr_, "L", on, T::bufsize);
+		return 0;
+	}
+
+	int get_led(bool *on) {
+		std::string result;
+		if(command("L,?", 350000, result) != 0)
+			return 1;
+
+		if(result.length() < 4 || (result[3] != '0' && result[3] != '1')) {
+			diag() << "Invalid LED state from device: " << result << std::endl;
+			return 1;
+		}
+
+		*on = (result[3] == '1');
+		return 0;
+	}
+
+	int info(std::string &out) {
+		std::string result;
+		if(command("I", 350000, result) != 0)
+			return 1;
+
+		if(result.length() < 3) {
+			diag() << "Invalid info string returned: " << result << std::endl;
+			return 1;
+		}
+
+		out = result.substr(3);
+		return 0;
+	}
+
+	int status(char *reason, float *vcc) {
+		if(send_status() != 0)
+			return 1;
+
+		usleep(350000); // Sleep min 300 milliseconds
+
+		return read_status(reason, vcc);
+	}
+
+	// status() in two halves, for callers that do something else while
+	// the circuit processes it
+	int send_status() {
+		return write_string("STATUS", dev_);
+	}
+
+	int read_status(char *reason, float *vcc) {
+		std::string result;
+		if(reply(result) != 0)
+			return 1;
+
+		if((result.length() < 8) || (sscanf(result.c_str() + 8, "%c,%f", reason, vcc) != 2)) {
+			diag() << "Invalid status string returned: " << result << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// Number of calibration points
+	int cal_status(int *points) {
+		std::string result;
+		if(command("Cal,?", 350000, result) != 0)
+			return 1;
+
+		if(result.length() < 6) {
+			diag() << "Invalid calibration state from device: " << result << std::endl;
+			return 1;
+		}
+
+		*points = result[5] - '0';
+		return 0;
+	}
+
+	int cal_clear() {
+		std::string result;
+		return command("Cal,clear", T::cal_clear_us, result);
+	}
+
+	// Runs a calibration sub-command; value is ignored unless op has a format
+	int cal(const ezo_cal_op &op, float value) {
+		std::string cmd = op.cmd;
+
+		if(op.fmt) {
+			char buf[16];
+			snprintf(buf, sizeof(buf), op.fmt, value);
+			cmd += std::string(",") + buf;
+		}
+
+		// Calibration measures, so the interference rules apply
+		quiet_wait(bus_);
+
+		std::string result;
+		return command(cmd, op.delay_us, result);
+	}
+
+	int sleep() {
+		return write_string("SLEEP", dev_);
+	}
+
+	// Moves the circuit to another I2C address. It restarts there, so
+	// there is no reply to read.
+	int set_address(int addr) {
+		char cmd[16];
+		snprintf(cmd, sizeof(cmd), "I2C,%d", addr);
+		return write_string(cmd, dev_);
+	}
+
+private:
+	ezo_driver(const ezo_driver &);
+	ezo_driver &operator=(const ezo_driver &);
+
+	// Parses as many values from the reading as there are names
+	int parse(const std::string &result, const std::vector<std::string> &names, std::vector<float> &values) {
+		std::string comp = comp_signature();
+		const char *pos = result.c_str();
+		values.clear();
+
+		for(size_t i=0; i<names.size(); i++) {
+			float value;
+			if(!pos || sscanf(pos, "%f", &value) != 1) {
+				diag() << "Float conversion of the result failed. The raw result was " << result << std::endl;
+				return 1;
+			}
+
+			cache_store(bus_, addr_, names[i], comp, value);
+			values.push_back(value);
+
+			pos = strchr(pos, ',');
+			if(pos) pos++;
+		}
+
+		return 0;
+	}
+
+	std::string bus_;
+	int addr_;
+	int dev_;
+	sample_window window_;
+	char reply_[EZO_REPLY_MAX + 1];  // Of fetch_values()
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef ATSCI_FILTER_H
+#define ATSCI_FILTER_H
+
+/*
+ * Streaming filters for the sampler. A chain is a list of stages applied in
+ * order to each new reading, like "median=5,ewma=0.3"; every stage keeps
+ * only the state it needs, so one update is cheap no matter how long the
+ * sampler has been running.
+ */
+
+#include <algorithm>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+enum filter_kind { FILTER_MEDIAN, FILTER_EWMA, FILTER_KALMAN };
+
+struct filter_stage {
+	filter_kind kind;
+	size_t window;        // median: number of readings
+	double alpha;         // ewma: weight of the new reading
+	double q, r;          // kalman: process and measurement noise variances
+
+	bool primed;
+	std::deque<double> history;
+	double x, p;          // ewma and kalman estimate, kalman error variance
+};
+
+typedef std::vector<filter_stage> filter_chain;
+
+// Parses one stage: median=<n>, ewma=<alpha> or kalman=<q>:<r>
+inline int parse_filter_stage(const std::string &spec, filter_stage &f) {
+	f.primed = false;
+	f.window = 0;
+	f.alpha = f.q = f.r = 0;
+	f.x = f.p = 0;
+
+	int n;
+	char c;
+
+	if(sscanf(spec.c_str(), "median=%d%c", &n, &c) == 1 && n > 0) {
+		f.kind = FILTER_MEDIAN;
+		f.window = n;
+		return 0;
+	}
+
+	if(sscanf(spec.c_str(), "ewma=%lf%c", &f.alpha, &c) == 1 && f.alpha > 0 && f.alpha <= 1) {
+		f.kind = FILTER_EWMA;
+		return 0;
+	}
+
+	if(sscanf(spec.c_str(), "kalman=%lf:%lf%c", &f.q, &f.r, &c) == 2 && f.q >= 0 && f.r > 0) {
+		f.kind = FILTER_KALMAN;
+		return 0;
+	}
+
+	return 1;
+}
+
+inline double filter_update(filter_stage &f, double value) {
+	switch(f.kind) {
+		case FILTER_MEDIAN: {
+			f.history.push_back(value);
+			if(f.history.size() > f.window)
+				f.history.pop_front();
+
+			std::vector<double> sorted(f.history.begin(), f.history.end());
+			size_t mid = sorted.size() / 2;
+			std::nth_element(sorted.begin(), sorted.begin() + mid, sorted.end());
+
+			if(sorted.size() % 2)
+				return sorted[mid];
+
+			double upper = sorted[mid];
+			return (upper + *std::max_element(sorted.begin(), sorted.begin() + mid)) / 2;
+		}
+
+		case FILTER_EWMA:
+			f.x = f.primed ? f.alpha * value + (1 - f.alpha) * f.x : value;
+			f.primed = true;
+			return f.x;
+
+		case FILTER_KALMAN:
+			// Constant level with random walk: predict, then correct
+			if(!f.primed) {
+				f.x = value;
+				f.p = f.r;
+				f.primed = true;
+				return f.x;
+			}
+
+			f.p += f.q;
+			{
+				double k = f.p / (f.p + f.r);
+				f.x += k * (value - f.x);
+				f.p *= (1 - k);
+			}
+			return f.x;
+	}
+
+	return value;
+}
+
+// The state of a stage as text: "<primed> <x> <p> <n> <history ...>"
+inline std::string filter_state(const filter_stage &f) {
+	std::ostringstream out;
+	out.precision(17);
+	out << f.primed << " " << f.x << " " << f.p << " " << f.history.size();
+
+	for(size_t i=0; i<f.history.size(); i++)
+		out << " " << f.history[i];
+
+	return out.str();
+}
+
+// Restores the state saved with filter_state(); returns 0 on success
+inline int filter_restore(filter_stage &f, const std::string &state) {
+	std::istringstream in(state);
+	filter_stage s = f;
+	size_t n;
+
+	if(!(in >> s.primed >> s.x >> s.p >> n) || (s.kind == FILTER_MEDIAN && n > s.window))
+		return 1;
+
+	s.history.clear();
+	for(size_t i=0; i<n; i++) {
+		double value;
+		if(!(in >> value))
+			return 1;
+
+		s.history.push_back(value);
+	}
+
+	f = s;
+	return 0;
+}
+
+inline double filter_chain_update(filter_chain &chain, double value) {
+	for(size_t i=0; i<chain.size(); i++)
+		value = filter_update(chain[i], value);
+
+	return value;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef ATSCI_FLEET_H
+#define ATSCI_FLEET_H
+
+/*
+ * The fleet file lists probes for the sampler, one per line, in the probe
+ * syntax of atsci_sampler ("<type>[:<address>][@<mux>:<channel>][,...]").
+ * Blank lines and lines starting with # are skipped. "addr fleet" of the
+ * tools appends "<type>:<address>[@<mux>:<channel>]" lines to it, and its
+ * addresses are taken even if the circuit is not connected.
+ */
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+#include "atsci_sched.h"
+
+// Appends the probes in the file to probes; nonzero if it cannot be opened
+inline int fleet_load(const std::string &path, std::vector<std::string> &probes) {
+	FILE *f = fopen(path.c_str(), "r");
+	if(!f)
+		return 1;
+
+	char line[256];
+	while(fgets(line, sizeof(line), f)) {
+		char spec[256];
+		if(sscanf(line, "%255s", spec) == 1 && spec[0] != '#')
+			probes.push_back(spec);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+// Where the probes are, for fleet_taken(); lines that do not parse are
+// reported and left out
+inline void fleet_places(const std::vector<std::string> &probes, std::vector<probe_place> &places) {
+	for(size_t i=0; i<probes.size(); i++) {
+		probe_place place;
+		if(parse_probe_place(probes[i], place) == 0)
+			places.push_back(place);
+	}
+}
+
+/*
+ * Whether a probe in places has addr, at the mux channel of route ("" for
+ * the bus itself). Probes behind other channels of the same mux do not
+ * count, as only one of them is switched through at a time; those on the
+ * bus itself or behind another mux are reachable from any channel, so
+ * they do.
+ */
+inline bool fleet_taken(const std::vector<probe_place> &places, const std::string &route, int addr) {
+	std::string node;
+	int mux, channel;
+	if(parse_mux(route, node, &mux, &channel) != 0)
+		return true;
+
+	for(size_t i=0; i<places.size(); i++) {
+		const probe_place &p = places[i];
+		if(p.addr == addr && (p.mux < 0 || mux < 0 || p.mux != mux || p.channel == channel))
+			return true;
+	}
+
+	return false;
+}
+
+inline int fleet_append(const std::string &path, const std::string &probe) {
+	FILE *f = fopen(path.c_str(), "a");
+	if(!f || fprintf(f, "%s\n", probe.c_str()) < 0 || fclose(f) != 0) {
+		perror(path.c_str());
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef ATSCI_HEALTH_H
+#define ATSCI_HEALTH_H
+
+/*
+ * Circuit breaker for the devices polled by the sampler. After
+ * HEALTH_THRESHOLD failed cycles in a row a device is quarantined: it is
+ * left out of the cycles until its backoff time has passed, and then tried
+ * once. Every failed retry doubles the backoff, up to HEALTH_BACKOFF_MAX_S,
+ * so a dead probe costs one try per backoff period instead of a failed
+ * transaction in every cycle.
+ */
+
+#define HEALTH_THRESHOLD 3
+#define HEALTH_BACKOFF_MIN_S 5
+#define HEALTH_BACKOFF_MAX_S 300
+
+enum health_state { HEALTH_OK, HEALTH_FAILING, HEALTH_QUARANTINED };
+
+struct device_health {
+	health_state state;
+	int failures;        // In a row
+	long total_ok;
+	long total_failed;
+	double backoff;      // Seconds
+	double retry_at;     // Monotonic time the quarantine ends
+};
+
+inline void health_init(device_health &h) {
+	h.state = HEALTH_OK;
+	h.failures = 0;
+	h.total_ok = 0;
+	h.total_failed = 0;
+	h.backoff = HEALTH_BACKOFF_MIN_S;
+	h.retry_at = 0;
+}
+
+inline const char *health_name(health_state state) {
+	switch(state) {
+		case HEALTH_OK: return "ok";
+		case HEALTH_FAILING: return "failing";
+		case HEALTH_QUARANTINED: return "quarantined";
+	}
+
+	return "unknown";
+}
+
+// Whether the device should be tried at time now
+inline bool health_available(const device_health &h, double now) {
+	return h.state != HEALTH_QUARANTINED || now >= h.retry_at;
+}
+
+// Records a successful cycle; returns true if the state changed
+inline bool health_ok(device_health &h) {
+	health_state old = h.state;
+
+	h.state = HEALTH_OK;
+	h.failures = 0;
+	h.total_ok++;
+	h.backoff = HEALTH_BACKOFF_MIN_S;
+
+	return h.state != old;
+}
+
+// Records a failed cycle; returns true if the state changed
+inline bool health_fail(device_health &h, double now) {
+	health_state old = h.state;
+
+	h.failures++;
+	h.total_failed++;
+
+	if(old == HEALTH_QUARANTINED) {
+		h.backoff *= 2;
+		if(h.backoff > HEALTH_BACKOFF_MAX_S)
+			h.backoff = HEALTH_BACKOFF_MAX_S;
+	}
+
+	if(h.failures >= HEALTH_THRESHOLD) {
+		h.state = HEALTH_QUARANTINED;
+		h.retry_at = now + h.backoff;
+	}
+
+	else h.state = HEALTH_FAILING;
+
+	// A failed retry changes the backoff, which is worth reporting too
+	return h.state != old || old == HEALTH_QUARANTINED;
+}
+
+#endif
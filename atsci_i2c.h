@@ -0,0 +1,171 @@
+#ifndef ATSCI_I2C_H
+#define ATSCI_I2C_H
+
+/*
+ * I2C transaction code shared by the atsci_* tools and atsci_sampler.
+ * Define EZO_BUFSIZE before including this to change the default reply
+ * buffer size (the pH circuit only needs 32 bytes).
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "atsci_transport.h"
+
+#ifndef EZO_BUFSIZE
+#define EZO_BUFSIZE 64
+#endif
+
+// Where the transaction code reports errors. The tools print everything on
+// stdout; the sampler keeps stdout for data and points this at stderr.
+inline std::ostream *&diag_stream() {
+	static std::ostream *stream = &std::cout;
+	return stream;
+}
+
+inline std::ostream &diag() {
+	return *diag_stream();
+}
+
+// Largest reply read, status byte included
+#define EZO_REPLY_MAX 64
+
+/*
+ * Reads the reply to the last command into out, which has room for
+ * EZO_REPLY_MAX + 1 bytes, as a string without the status byte. Nothing
+ * is allocated unless the reply is an error.
+ */
+inline int read_reply(int dev, char *out, int size = EZO_BUFSIZE) {
+	if(size > EZO_REPLY_MAX) size = EZO_REPLY_MAX;
+	memset(out, 0, EZO_REPLY_MAX + 1);
+
+	if(bus_read(dev, out, size) < 1) {
+		bus_perror("read");
+		diag() << "I2C read failed." << std::endl;
+		return 1;
+	}
+
+	// The text only; masking the status byte would turn 254 and 255 into
+	// codes that do not exist
+	for(int byte=1; byte<size; byte++)
+		out[byte] &= 0x7F;
+
+	if(out[0] != 1) {
+		diag() << "Command failed. The error from device was: ";
+		switch((unsigned char)out[0]) {
+			case 255: diag() << "No Data (no pending request)" << std::endl; break;
+			case 254: diag() << "Pending (request still being processed)" << std::endl; break;
+			case 2: diag() << "Failed (the request failed)" << std::endl; break;
+			default: diag() << "Unknown" << std::endl;
+		}
+
+		return 1;
+	}
+
+	memmove(out, out + 1, size);
+	return 0;
+}
+
+inline int read_string(std::string &out, int dev, int size = EZO_BUFSIZE) {
+	char buf[EZO_REPLY_MAX + 1];
+	out = "";
+
+	if(read_reply(dev, buf, size) != 0)
+		return 1;
+
+	out = buf;
+	return 0;
+}
+
+inline int write_string(const std::string &cmd, int dev) {
+	//diag() << "Writing: " << cmd << std::endl;
+
+	if(bus_write(dev, cmd.c_str(), cmd.size()) != (int)cmd.size()) {
+		bus_perror("write");
+		diag() << "I2C write failed." << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Opens the bus and selects the circuit at addr; returns the fd or -1
+inline int open_dev(const std::string &bus, int addr) {
+	int dev = bus_open(bus, addr);
+	if(dev < 0) {
+		if(errno == ENXIO) diag() << "Unable to set I2C slave address." << std::endl;
+		else diag() << "Failed to open the device node; exiting." << std::endl;
+		return -1;
+	}
+
+	return dev;
+}
+
+// Makes sure the output parameter (like "EC" or "%") is enabled in the
+// reading string.
+inline int ensure_output(int dev, const std::string &param, int size = EZO_BUFSIZE) {
+	if(write_string("O,?", dev) != 0)
+		return 1;
+
+	usleep(350000); // Sleep min 300 milliseconds
+
+	std::string result;
+	if(read_string(result, dev, size) != 0)
+		return 1;
+
+	if(result.find(param) == std::string::npos) {
+		if(write_string("O," + param + ",1", dev) != 0)
+			return 1;
+
+		usleep(350000); // Sleep min 300 milliseconds
+
+		if(read_string(result, dev, size) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Finds out which of the output parameters in order (NULL terminated, in
+// the order the device prints them) are enabled in the reading string.
+inline int query_outputs(int dev, const char *const *order, std::vector<std::string> &names,
+                         int size = EZO_BUFSIZE) {
+	names.clear();
+
+	if(write_string("O,?", dev) != 0)
+		return 1;
+
+	usleep(350000); // Sleep min 300 milliseconds
+
+	std::string result;
+	if(read_string(result, dev, size) != 0)
+		return 1;
+
+	std::vector<std::string> enabled;
+	size_t pos = 0;
+	while(pos <= result.size()) {
+		size_t comma = result.find(',', pos);
+		if(comma == std::string::npos) comma = result.size();
+		enabled.push_back(result.substr(pos, comma - pos));
+		pos = comma + 1;
+	}
+
+	for(int i=0; order[i]; i++)
+		for(size_t j=0; j<enabled.size(); j++)
+			if(enabled[j] == order[i])
+				names.push_back(order[i]);
+
+	if(names.empty()) {
+		diag() << "No output parameters enabled: " << result << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif
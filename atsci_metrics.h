@@ -0,0 +1,438 @@
+#ifndef ATSCI_METRICS_H
+#define ATSCI_METRICS_H
+
+/*
+ * OpenMetrics exporter for the sampler. The measuring thread records the
+ * latest readings, the STATUS of each circuit, the cycle results and the
+ * duration of the bus transactions in a metrics_store; a server thread
+ * answers GET /metrics on a TCP port or a Unix socket from a copy of it,
+ * so a scrape never touches the bus. The lock is only held to update or
+ * copy the store.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Upper bounds of the transaction duration buckets, in seconds
+static const double metrics_bounds[] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5 };
+#define METRICS_BUCKETS (sizeof(metrics_bounds) / sizeof(metrics_bounds[0]))
+
+/*
+ * A number in the canonical form OpenMetrics wants in labels like le: the
+ * shortest one that reads back as the same double, with ".0" after an
+ * integer and no exponent for one, like 1.0 or 1000000.0.
+ */
+inline void metrics_float(char *buf, size_t size, double value) {
+	if(value == floor(value) && fabs(value) < 1e15) {
+		snprintf(buf, size, "%.1f", value);
+		return;
+	}
+
+	for(int digits=1; digits<=17; digits++) {
+		snprintf(buf, size, "%.*g", digits, value);
+		if(strtod(buf, NULL) == value)
+			return;
+	}
+}
+
+// Transactions timed per probe
+enum metrics_op { METRICS_WRITE, METRICS_READ, METRICS_OPS };
+
+struct metrics_hist {
+	long counts[METRICS_BUCKETS + 1];  // The last one for larger
+	long count;
+	double sum;
+};
+
+struct probe_metrics {
+	std::string label;
+	std::vector<std::string> params;
+	std::vector<float> values;
+	std::vector<float> filtered;
+	bool has_filter;
+	double taken;        // CLOCK_REALTIME of the reading, 0 before the first
+
+	bool have_status;
+	char reason;
+	float vcc;
+
+	const char *health;
+	int failures;        // In a row
+	long total_ok;
+	long total_failed;
+
+	metrics_hist hist[METRICS_OPS];
+};
+
+class metrics_store {
+public:
+	metrics_store() {
+		pthread_mutex_init(&lock_, NULL);
+	}
+
+	~metrics_store() {
+		pthread_mutex_destroy(&lock_);
+	}
+
+	// Adds a probe before the sampling starts; returns its index
+	size_t add_probe(const std::string &label, const char *const *params, bool has_filter) {
+		probe_metrics p;
+		p.label = label;
+		for(size_t i=0; params[i]; i++)
+			p.params.push_back(params[i]);
+
+		p.values.resize(p.params.size(), 0);
+		p.filtered.resize(p.params.size(), 0);
+		p.has_filter = has_filter;
+		p.taken = 0;
+		p.have_status = false;
+		p.health = "ok";
+		p.failures = 0;
+		p.total_ok = 0;
+		p.total_failed = 0;
+		memset(p.hist, 0, sizeof(p.hist));
+
+		probes_.push_back(p);
+		return probes_.size() - 1;
+	}
+
+	void reading(size_t probe, size_t param, float value, float filtered, const struct timespec &taken) {
+		pthread_mutex_lock(&lock_);
+		probe_metrics &p = probes_[probe];
+		p.values[param] = value;
+		p.filtered[param] = filtered;
+		p.taken = taken.tv_sec + taken.tv_nsec / 1e9;
+		pthread_mutex_unlock(&lock_);
+	}
+
+	void status(size_t probe, char reason, float vcc) {
+		pthread_mutex_lock(&lock_);
+		probes_[probe].have_status = true;
+		probes_[probe].reason = reason;
+		probes_[probe].vcc = vcc;
+		pthread_mutex_unlock(&lock_);
+	}
+
+	void health(size_t probe, const char *state, int failures, long total_ok, long total_failed) {
+		pthread_mutex_lock(&lock_);
+		probe_metrics &p = probes_[probe];
+		p.health = state;
+		p.failures = failures;
+		p.total_ok = total_ok;
+		p.total_failed = total_failed;
+		pthread_mutex_unlock(&lock_);
+	}
+
+	void latency(size_t probe, metrics_op op, double seconds) {
+		size_t bucket = 0;
+		while(bucket < METRICS_BUCKETS && seconds > metrics_bounds[bucket])
+			bucket++;
+
+		pthread_mutex_lock(&lock_);
+		metrics_hist &h = probes_[probe].hist[op];
+		h.counts[bucket]++;
+		h.count++;
+		h.sum += seconds;
+		pthread_mutex_unlock(&lock_);
+	}
+
+	// The exposition of everything in the store
+	std::string format() {
+		pthread_mutex_lock(&lock_);
+		std::vector<probe_metrics> probes = probes_;
+		pthread_mutex_unlock(&lock_);
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		double now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+		std::string out;
+
+		out += "# TYPE atsci_reading gauge\n"
+		       "# HELP atsci_reading Latest reading of the parameter.\n";
+		for(size_t i=0; i<probes.size(); i++)
+			for(size_t j=0; probes[i].taken && j<probes[i].params.size(); j++)
+				line(out, "atsci_reading", probes[i], "param", probes[i].params[j].c_str(), "%g", probes[i].values[j]);
+
+		out += "# TYPE atsci_reading_filtered gauge\n"
+		       "# HELP atsci_reading_filtered Latest reading through the filters of the probe.\n";
+		for(size_t i=0; i<probes.size(); i++)
+			for(size_t j=0; probes[i].taken && probes[i].has_filter && j<probes[i].params.size(); j++)
+				line(out, "atsci_reading_filtered", probes[i], "param", probes[i].params[j].c_str(), "%g",
+				     probes[i].filtered[j]);
+
+		out += "# TYPE atsci_reading_age_seconds gauge\n"
+		       "# HELP atsci_reading_age_seconds Time since the latest reading.\n"
+		       "# UNIT atsci_reading_age_seconds seconds\n";
+		for(size_t i=0; i<probes.size(); i++)
+			if(probes[i].taken)
+				line(out, "atsci_reading_age_seconds", probes[i], NULL, NULL, "%.3f", now - probes[i].taken);
+
+		out += "# TYPE atsci_vcc_volts gauge\n"
+		       "# HELP atsci_vcc_volts Supply voltage at the VCC pin, from STATUS.\n"
+		       "# UNIT atsci_vcc_volts volts\n";
+		for(size_t i=0; i<probes.size(); i++)
+			if(probes[i].have_status)
+				line(out, "atsci_vcc_volts", probes[i], NULL, NULL, "%.3f", probes[i].vcc);
+
+		out += "# TYPE atsci_restart info\n"
+		       "# HELP atsci_restart Reason of the last restart, from STATUS.\n";
+		for(size_t i=0; i<probes.size(); i++) {
+			char reason[2] = { probes[i].reason, 0 };
+			if(probes[i].have_status)
+				line(out, "atsci_restart_info", probes[i], "reason", reason, "%d", 1);
+		}
+
+		out += "# TYPE atsci_health stateset\n"
+		       "# HELP atsci_health State of the circuit breaker of the probe.\n";
+		for(size_t i=0; i<probes.size(); i++) {
+			static const char *states[] = { "ok", "failing", "quarantined" };
+			for(size_t s=0; s<3; s++)
+				line(out, "atsci_health", probes[i], "atsci_health", states[s], "%d",
+				     !strcmp(states[s], probes[i].health));
+		}
+
+		out += "# TYPE atsci_failures gauge\n"
+		       "# HELP atsci_failures Failed cycles in a row.\n";
+		for(size_t i=0; i<probes.size(); i++)
+			line(out, "atsci_failures", probes[i], NULL, NULL, "%d", probes[i].failures);
+
+		out += "# TYPE atsci_cycles counter\n"
+		       "# HELP atsci_cycles Cycles the probe was converted in, by result.\n";
+		for(size_t i=0; i<probes.size(); i++) {
+			line(out, "atsci_cycles_total", probes[i], "result", "ok", "%ld", probes[i].total_ok);
+			line(out, "atsci_cycles_total", probes[i], "result", "failed", "%ld", probes[i].total_failed);
+		}
+
+		out += "# TYPE atsci_transaction_seconds histogram\n"
+		       "# HELP atsci_transaction_seconds Duration of the R command and of fetching the reading.\n"
+		       "# UNIT atsci_transaction_seconds seconds\n";
+		for(size_t i=0; i<probes.size(); i++)
+			for(int op=0; op<METRICS_OPS; op++)
+				histogram(out, probes[i], op == METRICS_WRITE ? "write" : "read", probes[i].hist[op]);
+
+		out += "# EOF\n";
+		return out;
+	}
+
+private:
+	metrics_store(const metrics_store &);
+	metrics_store &operator=(const metrics_store &);
+
+	static void line(std::string &out, const char *name, const probe_metrics &p, const char *label,
+	                 const char *value, const char *fmt, ...) {
+		char buf[256];
+		int len;
+
+		if(label) len = snprintf(buf, sizeof(buf), "%s{probe=\"%s\",%s=\"%s\"} ", name, p.label.c_str(), label, value);
+		else len = snprintf(buf, sizeof(buf), "%s{probe=\"%s\"} ", name, p.label.c_str());
+
+		va_list ap;
+		va_start(ap, fmt);
+		if(len >= 0 && (size_t)len < sizeof(buf))
+			vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+		va_end(ap);
+
+		out += buf;
+		out += "\n";
+	}
+
+	static void histogram(std::string &out, const probe_metrics &p, const char *op, const metrics_hist &h) {
+		char buf[256];
+		long total = 0;
+
+		for(size_t b=0; b<=METRICS_BUCKETS; b++) {
+			total += h.counts[b];
+
+			char le[32];
+			if(b == METRICS_BUCKETS) snprintf(le, sizeof(le), "+Inf");
+			else metrics_float(le, sizeof(le), metrics_bounds[b]);
+
+			snprintf(buf, sizeof(buf), "atsci_transaction_seconds_bucket{probe=\"%s\",op=\"%s\",le=\"%s\"} %ld\n",
+			         p.label.c_str(), op, le, total);
+			out += buf;
+		}
+
+		snprintf(buf, sizeof(buf), "atsci_transaction_seconds_count{probe=\"%s\",op=\"%s\"} %ld\n"
+		         "atsci_transaction_seconds_sum{probe=\"%s\",op=\"%s\"} %.6f\n",
+		         p.label.c_str(), op, h.count, p.label.c_str(), op, h.sum);
+		out += buf;
+	}
+
+	pthread_mutex_t lock_;
+	std::vector<probe_metrics> probes_;
+};
+
+/*
+ * Serves the store over HTTP, one connection at a time, on [<host>:]<port>
+ * (localhost by default) or on a Unix socket given as a path.
+ */
+class metrics_server {
+public:
+	metrics_server(metrics_store &store) : store_(store), sock_(-1), done_(0) {}
+
+	~metrics_server() {
+		if(sock_ >= 0)
+			close(sock_);
+	}
+
+	int listen_on(const std::string &where) {
+		if(where.find('/') != std::string::npos)
+			return listen_unix(where);
+
+		std::string host = "127.0.0.1";
+		std::string port = where;
+		size_t colon = where.rfind(':');
+		if(colon != std::string::npos) {
+			host = where.substr(0, colon);
+			port = where.substr(colon + 1);
+		}
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(port.c_str()));
+
+		if(inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 || addr.sin_port == 0) {
+			std::cerr << "Invalid metrics address: " << where << std::endl;
+			return 1;
+		}
+
+		sock_ = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		if(sock_ >= 0)
+			setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		return bind_listen((struct sockaddr *)&addr, sizeof(addr), where);
+	}
+
+	int start() {
+		if(pthread_create(&thread_, NULL, &metrics_server::run, this) != 0) {
+			std::cerr << "Unable to start the metrics server." << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	void stop() {
+		__atomic_store_n(&done_, 1, __ATOMIC_RELEASE);
+		pthread_join(thread_, NULL);
+	}
+
+private:
+	metrics_server(const metrics_server &);
+	metrics_server &operator=(const metrics_server &);
+
+	int listen_unix(const std::string &path) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+		// Left over from an earlier run
+		unlink(path.c_str());
+
+		sock_ = socket(AF_UNIX, SOCK_STREAM, 0);
+		return bind_listen((struct sockaddr *)&addr, sizeof(addr), path);
+	}
+
+	int bind_listen(const struct sockaddr *addr, socklen_t len, const std::string &where) {
+		if(sock_ < 0 || bind(sock_, addr, len) != 0 || listen(sock_, 4) != 0) {
+			perror("metrics");
+			std::cerr << "Unable to serve metrics on " << where << "." << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	static void *run(void *arg) {
+		static_cast<metrics_server *>(arg)->serve();
+		return NULL;
+	}
+
+	void serve() {
+		while(!__atomic_load_n(&done_, __ATOMIC_ACQUIRE)) {
+			struct pollfd pfd = { sock_, POLLIN, 0 };
+			if(poll(&pfd, 1, 1000) <= 0)
+				continue;
+
+			int conn = accept(sock_, NULL, NULL);
+			if(conn < 0)
+				continue;
+
+			struct timeval tv = { 2, 0 };
+			setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+			answer(conn);
+			close(conn);
+		}
+	}
+
+	void answer(int conn) {
+		std::string request;
+		char buf[1024];
+
+		while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+			ssize_t n = recv(conn, buf, sizeof(buf), 0);
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			if(n <= 0)
+				return;
+
+			request.append(buf, n);
+		}
+
+		std::string status = "200 OK", type = "application/openmetrics-text; version=1.0.0; charset=utf-8", body;
+
+		if(request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0)
+			body = store_.format();
+		else {
+			status = "404 Not Found";
+			type = "text/plain";
+			body = "Not found\n";
+		}
+
+		char head[256];
+		snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n"
+		         "Connection: close\r\n\r\n", status.c_str(), type.c_str(), (unsigned long)body.size());
+
+		std::string reply = head + body;
+		for(size_t done = 0; done < reply.size(); ) {
+			ssize_t n = send(conn, reply.data() + done, reply.size() - done, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			if(n <= 0)
+				return;
+
+			done += n;
+		}
+	}
+
+	metrics_store &store_;
+	int sock_;
+	int done_;
+	pthread_t thread_;
+};
+
+#endif
@@ -0,0 +1,424 @@
+#ifndef ATSCI_MQTT_H
+#define ATSCI_MQTT_H
+
+/*
+ * Output sink publishing the sampler output to an MQTT 3.1.1 broker, over
+ * one connection kept open by the writer thread. Each line becomes a
+ * message: "<probe> <parameter> <value ...>" is published to the topic
+ * <prefix>/<probe>/<parameter> with the rest of the line as the payload,
+ * and a line of two words "<a> <b>" to <prefix>/<a> with payload b.
+ *
+ * The messages of a cycle go out together in as few writes as possible.
+ * While the broker cannot be reached they are queued, up to the capacity
+ * of the sink; the oldest are then dropped and counted like lines dropped
+ * from the ring. Messages published with QoS 1 stay queued until the
+ * broker acknowledges them, and are sent again after a reconnect.
+ */
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <string>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "atsci_output.h"
+
+#define MQTT_PORT 1883
+#define MQTT_KEEPALIVE_S 60
+#define MQTT_TIMEOUT_S 5
+#define MQTT_RETRY_MIN_S 1
+#define MQTT_RETRY_MAX_S 60
+
+struct mqtt_msg {
+	std::string topic;
+	std::string payload;
+	unsigned short id;   // 0 until sent with QoS 1
+};
+
+class mqtt_sink : public output_sink {
+public:
+	mqtt_sink(const std::string &host, int port, const std::string &prefix, int qos, size_t capacity,
+	          output_policy policy) :
+		output_sink(mqtt_name(host, port), -1, false, capacity, policy),
+		host_(host), port_(port), prefix_(prefix), qos_(qos), capacity_(capacity), sock_(-1),
+		next_id_(0), retry_at_(0), backoff_(MQTT_RETRY_MIN_S), last_sent_(0) {}
+
+	~mqtt_sink() {
+		if(sock_ >= 0)
+			close(sock_);
+	}
+
+protected:
+	void write_line(const char *text) {
+		std::string line(text);
+		if(!line.empty() && line[line.size()-1] == '\n')
+			line.erase(line.size()-1);
+
+		size_t sp1 = line.find(' ');
+		if(sp1 == std::string::npos)
+			return;
+
+		mqtt_msg msg;
+		msg.id = 0;
+
+		size_t sp2 = line.find(' ', sp1 + 1);
+		if(sp2 == std::string::npos) {
+			msg.topic = prefix_ + "/" + line.substr(0, sp1);
+			msg.payload = line.substr(sp1 + 1);
+		}
+
+		else {
+			msg.topic = prefix_ + "/" + line.substr(0, sp1) + "/" + line.substr(sp1 + 1, sp2 - sp1 - 1);
+			msg.payload = line.substr(sp2 + 1);
+		}
+
+		// Make room by dropping the oldest message not yet on its way
+		if(queue_.size() + inflight_.size() >= capacity_) {
+			if(queue_.empty()) {
+				count_dropped();
+				return;
+			}
+
+			queue_.pop_front();
+			count_dropped();
+		}
+
+		queue_.push_back(msg);
+	}
+
+	void end_batch() {
+		service();
+	}
+
+	void idle() {
+		service();
+
+		// Nothing sent for a while, so let the broker know we are here
+		if(sock_ >= 0 && now() - last_sent_ >= MQTT_KEEPALIVE_S / 2) {
+			std::string ping("\xc0\x00", 2);
+			send_packets(ping);
+		}
+	}
+
+	void finish() {
+		service();
+
+		// A moment for the acknowledgements still on their way
+		for(double end = now() + MQTT_TIMEOUT_S; sock_ >= 0 && !inflight_.empty() && now() < end; ) {
+			usleep(10000);
+			receive();
+		}
+
+		if(sock_ >= 0) {
+			std::string bye("\xe0\x00", 2);
+			send_packets(bye);
+			close(sock_);
+			sock_ = -1;
+		}
+
+		if(!queue_.empty() || !inflight_.empty())
+			std::cerr << queue_.size() + inflight_.size() << " messages not delivered to " << name() << "."
+			          << std::endl;
+	}
+
+private:
+	static std::string mqtt_name(const std::string &host, int port) {
+		char name[128];
+		snprintf(name, sizeof(name), "mqtt://%s:%d", host.c_str(), port);
+		return name;
+	}
+
+	static double now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+	static void put_length(std::string &out, size_t len) {
+		do {
+			unsigned char byte = len % 128;
+			len /= 128;
+			out += (char)(len ? byte | 0x80 : byte);
+		} while(len);
+	}
+
+	static void put_string(std::string &out, const std::string &s) {
+		out += (char)(s.size() >> 8);
+		out += (char)(s.size() & 0xFF);
+		out += s;
+	}
+
+	static std::string packet(unsigned char type, const std::string &body) {
+		std::string out(1, (char)type);
+		put_length(out, body.size());
+		return out + body;
+	}
+
+	void publish(std::string &out, const mqtt_msg &msg, bool dup) {
+		std::string body;
+		put_string(body, msg.topic);
+
+		if(qos_) {
+			body += (char)(msg.id >> 8);
+			body += (char)(msg.id & 0xFF);
+		}
+
+		body += msg.payload;
+		out += packet(0x30 | (qos_ << 1) | (dup ? 0x08 : 0), body);
+	}
+
+	int connect_broker() {
+		char port[16];
+		snprintf(port, sizeof(port), "%d", port_);
+
+		struct addrinfo hints, *res;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		int err = getaddrinfo(host_.c_str(), port, &hints, &res);
+		if(err != 0) {
+			std::cerr << name() << ": " << gai_strerror(err) << std::endl;
+			return 1;
+		}
+
+		for(struct addrinfo *ai = res; ai && sock_ < 0; ai = ai->ai_next) {
+			sock_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if(sock_ < 0)
+				continue;
+
+			struct timeval tv = { MQTT_TIMEOUT_S, 0 };
+			setsockopt(sock_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+			if(connect(sock_, ai->ai_addr, ai->ai_addrlen) != 0) {
+				close(sock_);
+				sock_ = -1;
+			}
+		}
+
+		freeaddrinfo(res);
+
+		if(sock_ < 0) {
+			std::cerr << name() << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+
+		// The batches are already as large as they get
+		int one = 1;
+		setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		char client[32];
+		snprintf(client, sizeof(client), "atsci-%d", (int)getpid());
+
+		std::string body;
+		put_string(body, "MQTT");
+		body += (char)4;      // Protocol level 3.1.1
+		body += (char)0x02;   // Clean session
+		body += (char)(MQTT_KEEPALIVE_S >> 8);
+		body += (char)(MQTT_KEEPALIVE_S & 0xFF);
+		put_string(body, client);
+
+		unsigned char connack[4];
+		if(send_packets(packet(0x10, body)) != 0 || recv_all(connack, sizeof(connack)) != 0)
+			return 1;
+
+		if(connack[0] != 0x20 || connack[3] != 0) {
+			std::cerr << name() << ": connection refused (" << (int)connack[3] << ")." << std::endl;
+			disconnect();
+			return 1;
+		}
+
+		std::cerr << name() << ": connected." << std::endl;
+		return 0;
+	}
+
+	void disconnect() {
+		if(sock_ < 0)
+			return;
+
+		close(sock_);
+		sock_ = -1;
+		in_.clear();
+
+		// Unacknowledged messages go out again first
+		queue_.insert(queue_.begin(), inflight_.begin(), inflight_.end());
+		inflight_.clear();
+	}
+
+	int send_packets(const std::string &data) {
+		size_t done = 0;
+
+		while(done < data.size()) {
+			ssize_t n = send(sock_, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			if(n <= 0) {
+				std::cerr << name() << ": " << strerror(errno) << std::endl;
+				disconnect();
+				return 1;
+			}
+
+			done += n;
+		}
+
+		last_sent_ = now();
+		return 0;
+	}
+
+	int recv_all(unsigned char *buf, size_t size) {
+		size_t done = 0;
+
+		while(done < size) {
+			ssize_t n = recv(sock_, buf + done, size - done, 0);
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			if(n <= 0) {
+				std::cerr << name() << ": " << (n == 0 ? "connection closed" : strerror(errno)) << std::endl;
+				disconnect();
+				return 1;
+			}
+
+			done += n;
+		}
+
+		return 0;
+	}
+
+	// Takes the acknowledgements the broker has sent, without waiting
+	void receive() {
+		char buf[512];
+
+		while(sock_ >= 0) {
+			ssize_t n = recv(sock_, buf, sizeof(buf), MSG_DONTWAIT);
+			if(n > 0) {
+				in_.append(buf, n);
+				continue;
+			}
+
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			std::cerr << name() << ": " << (n == 0 ? "connection closed" : strerror(errno)) << std::endl;
+			disconnect();
+			return;
+		}
+
+		for(;;) {
+			// Packet type, then the remaining length in up to 4 bytes
+			size_t len = 0, pos = 1;
+			bool have_len = false;
+
+			for(int shift = 0; pos < in_.size() && pos <= 4 && !have_len; shift += 7) {
+				unsigned char byte = in_[pos++];
+				len |= (size_t)(byte & 0x7F) << shift;
+				have_len = !(byte & 0x80);
+			}
+
+			if(!have_len || in_.size() < pos + len)
+				return;
+
+			// PUBACK; PINGRESP needs nothing
+			if((unsigned char)in_[0] == 0x40 && len == 2) {
+				unsigned short id = ((unsigned char)in_[pos] << 8) | (unsigned char)in_[pos+1];
+
+				for(std::deque<mqtt_msg>::iterator i = inflight_.begin(); i != inflight_.end(); ++i)
+					if(i->id == id) {
+						inflight_.erase(i);
+						break;
+					}
+			}
+
+			in_.erase(0, pos + len);
+		}
+	}
+
+	// Connects if needed and sends everything queued in one go
+	void service() {
+		if(sock_ < 0) {
+			if(now() < retry_at_)
+				return;
+
+			if(connect_broker() != 0) {
+				retry_at_ = now() + backoff_;
+				backoff_ = std::min(backoff_ * 2, (double)MQTT_RETRY_MAX_S);
+				return;
+			}
+
+			backoff_ = MQTT_RETRY_MIN_S;
+		}
+
+		receive();
+
+		std::string out;
+		size_t count = queue_.size();
+
+		for(size_t i=0; i<count && sock_ >= 0; i++) {
+			mqtt_msg &msg = queue_[i];
+			bool dup = (msg.id != 0);
+
+			if(qos_ && !msg.id) {
+				if(++next_id_ == 0) next_id_ = 1;
+				msg.id = next_id_;
+			}
+
+			publish(out, msg, dup && qos_);
+		}
+
+		if(out.empty() || send_packets(out) != 0)
+			return;
+
+		if(qos_)
+			inflight_.insert(inflight_.end(), queue_.begin(), queue_.begin() + count);
+
+		queue_.erase(queue_.begin(), queue_.begin() + count);
+		receive();
+	}
+
+	std::string host_;
+	int port_;
+	std::string prefix_;
+	int qos_;
+	size_t capacity_;
+
+	// Used by the writer thread only
+	int sock_;
+	std::string in_;
+	std::deque<mqtt_msg> queue_;      // Not sent yet
+	std::deque<mqtt_msg> inflight_;   // Sent with QoS 1, not acknowledged
+	unsigned short next_id_;
+	double retry_at_;
+	double backoff_;
+	double last_sent_;
+};
+
+// Parses <host>[:<port>]
+inline int parse_mqtt_broker(const std::string &spec, std::string &host, int *port) {
+	size_t colon = spec.rfind(':');
+	host = spec;
+	*port = MQTT_PORT;
+
+	if(colon != std::string::npos) {
+		host = spec.substr(0, colon);
+		if(sscanf(spec.c_str() + colon + 1, "%d", port) != 1 || *port < 1 || *port > 65535)
+			return 1;
+	}
+
+	return host.empty();
+}
+
+#endif
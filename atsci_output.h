@@ -0,0 +1,334 @@
+#ifndef ATSCI_OUTPUT_H
+#define ATSCI_OUTPUT_H
+
+/*
+ * Output of the sampler. The measuring thread formats each line into a
+ * fixed size record and pushes it into the ring of every sink; a writer
+ * thread per sink drains its ring to a file descriptor. A stalled pipe or
+ * a slow fsync then only fills a ring, instead of delaying the next bus
+ * transaction.
+ *
+ * When a ring is full the line is dropped and counted (OUTPUT_DROP), or
+ * the measuring thread waits for room (OUTPUT_BLOCK). The writer reports
+ * new drops in the stream itself as "dropped <total>" lines.
+ *
+ * Sinks that do not write to a file descriptor (see atsci_mqtt.h) override
+ * write_line(), end_batch(), idle() and finish(), all called from the
+ * writer thread.
+ *
+ * The measuring thread writes nothing else itself either: its diagnostics
+ * go through a sink_streambuf into a sink on stderr, and the files it
+ * replaces, like the state entries and the snapshot, to a file_writer.
+ */
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atsci_ring.h"
+#include "atsci_state.h"
+
+#define OUTPUT_LINE_MAX 160
+
+enum output_policy { OUTPUT_DROP, OUTPUT_BLOCK };
+
+struct output_line {
+	char text[OUTPUT_LINE_MAX];
+};
+
+class output_sink {
+public:
+	// sync: fdatasync after every batch written, for files
+	output_sink(const std::string &name, int fd, bool sync, size_t capacity, output_policy policy) :
+		name_(name), fd_(fd), sync_(sync), policy_(policy), ring_(capacity), dropped_(0), done_(0) {
+		sem_init(&ready_, 0, 0);
+	}
+
+	virtual ~output_sink() {
+		sem_destroy(&ready_);
+	}
+
+	int start() {
+		if(pthread_create(&thread_, NULL, &output_sink::run, this) != 0) {
+			std::cerr << "Unable to start the writer for " << name_ << "." << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// Writes everything still in the ring and waits for the writer to exit
+	void stop() {
+		__atomic_store_n(&done_, 1, __ATOMIC_RELEASE);
+		sem_post(&ready_);
+		pthread_join(thread_, NULL);
+	}
+
+	void push(const output_line &line) {
+		while(!ring_.push(line)) {
+			if(policy_ == OUTPUT_DROP) {
+				__atomic_add_fetch(&dropped_, 1, __ATOMIC_RELAXED);
+				return;
+			}
+
+			usleep(1000);
+		}
+
+		sem_post(&ready_);
+	}
+
+	const std::string &name() const { return name_; }
+	unsigned long dropped() const { return __atomic_load_n(&dropped_, __ATOMIC_RELAXED); }
+
+protected:
+	virtual void write_line(const char *text) {
+		write_all(text);
+	}
+
+	// After the lines available at once have been written
+	virtual void end_batch() {
+		if(sync_)
+			fdatasync(fd_);
+	}
+
+	// When no lines have come for a second
+	virtual void idle() {}
+
+	// Before the writer exits
+	virtual void finish() {}
+
+	// For lines a sink loses after taking them from the ring
+	void count_dropped() {
+		__atomic_add_fetch(&dropped_, 1, __ATOMIC_RELAXED);
+	}
+
+private:
+	output_sink(const output_sink &);
+	output_sink &operator=(const output_sink &);
+
+	static void *run(void *arg) {
+		static_cast<output_sink *>(arg)->drain();
+		return NULL;
+	}
+
+	void drain() {
+		unsigned long reported = 0;
+		output_line line;
+
+		for(;;) {
+			struct timespec timeout;
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec++;
+
+			int ret;
+			while((ret = sem_timedwait(&ready_, &timeout)) != 0 && errno == EINTR);
+
+			if(ret != 0) {
+				idle();
+				continue;
+			}
+
+			bool done = __atomic_load_n(&done_, __ATOMIC_ACQUIRE);
+
+			// Take everything there is, so one sync covers a whole cycle
+			bool wrote = false;
+			while(ring_.pop(line)) {
+				write_line(line.text);
+				wrote = true;
+			}
+
+			unsigned long dropped = this->dropped();
+			if(dropped != reported) {
+				snprintf(line.text, sizeof(line.text), "dropped %lu\n", dropped);
+				write_line(line.text);
+				reported = dropped;
+				wrote = true;
+			}
+
+			if(wrote)
+				end_batch();
+
+			if(done) {
+				finish();
+				return;
+			}
+		}
+	}
+
+	void write_all(const char *text) {
+		size_t left = strlen(text);
+
+		while(left > 0) {
+			ssize_t n = write(fd_, text, left);
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			// Nothing to tell the data stream about its own failure
+			if(n <= 0)
+				return;
+
+			text += n;
+			left -= n;
+		}
+	}
+
+	std::string name_;
+	int fd_;
+	bool sync_;
+	output_policy policy_;
+	spsc_ring<output_line> ring_;
+	unsigned long dropped_;
+	int done_;
+	sem_t ready_;
+	pthread_t thread_;
+};
+
+/*
+ * A stream buffer that pushes each line written to it into a sink. The
+ * characters are collected in a record until the newline, so nothing is
+ * allocated; a longer line is split.
+ */
+class sink_streambuf : public std::streambuf {
+public:
+	explicit sink_streambuf(output_sink &sink) : sink_(sink), len_(0) {}
+
+protected:
+	virtual int overflow(int c) {
+		if(c == traits_type::eof())
+			return traits_type::not_eof(c);
+
+		line_.text[len_++] = (char)c;
+
+		if(c == '\n' || len_ == OUTPUT_LINE_MAX - 2) {
+			if(c != '\n')
+				line_.text[len_++] = '\n';
+
+			line_.text[len_] = '\0';
+			sink_.push(line_);
+			len_ = 0;
+		}
+
+		return c;
+	}
+
+private:
+	output_sink &sink_;
+	output_line line_;
+	size_t len_;
+};
+
+/*
+ * Writer thread for files replaced as a whole through state_file_write().
+ * A write that does not fit in the ring is dropped and counted; the next
+ * write of the same file brings it up to date again.
+ */
+class file_writer {
+public:
+	explicit file_writer(size_t capacity) : ring_(capacity), dropped_(0), done_(0) {
+		sem_init(&ready_, 0, 0);
+	}
+
+	~file_writer() {
+		file_job *job;
+		while(ring_.pop(job))
+			delete job;
+
+		sem_destroy(&ready_);
+	}
+
+	int start() {
+		if(pthread_create(&thread_, NULL, &file_writer::run, this) != 0) {
+			std::cerr << "Unable to start the file writer." << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// Writes everything still in the ring and waits for the writer to exit
+	void stop() {
+		__atomic_store_n(&done_, 1, __ATOMIC_RELEASE);
+		sem_post(&ready_);
+		pthread_join(thread_, NULL);
+	}
+
+	// sync: flush the file to the disk before renaming it into place
+	void push(const std::string &path, const std::string &data, bool sync) {
+		file_job *job = new file_job;
+		job->path = path;
+		job->data = data;
+		job->sync = sync;
+
+		if(!ring_.push(job)) {
+			delete job;
+			__atomic_add_fetch(&dropped_, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		sem_post(&ready_);
+	}
+
+	unsigned long dropped() const { return __atomic_load_n(&dropped_, __ATOMIC_RELAXED); }
+
+private:
+	file_writer(const file_writer &);
+	file_writer &operator=(const file_writer &);
+
+	struct file_job {
+		std::string path;
+		std::string data;
+		bool sync;
+	};
+
+	static void *run(void *arg) {
+		static_cast<file_writer *>(arg)->drain();
+		return NULL;
+	}
+
+	void drain() {
+		for(;;) {
+			while(sem_wait(&ready_) != 0 && errno == EINTR);
+
+			bool done = __atomic_load_n(&done_, __ATOMIC_ACQUIRE);
+
+			file_job *job;
+			while(ring_.pop(job)) {
+				if(state_file_write(job->path, job->data, job->sync) != 0)
+					std::cerr << "Unable to write " << job->path << ": " << strerror(errno) << std::endl;
+
+				delete job;
+			}
+
+			if(done)
+				return;
+		}
+	}
+
+	spsc_ring<file_job *> ring_;
+	unsigned long dropped_;
+	int done_;
+	sem_t ready_;
+	pthread_t thread_;
+};
+
+// The writer of the deferred state writes, for state_deferred()
+inline file_writer *&state_file_writer() {
+	static file_writer *writer = NULL;
+	return writer;
+}
+
+inline void state_write_later(const std::string &path, const std::string &data) {
+	state_file_writer()->push(path, data, false);
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef ATSCI_RING_H
+#define ATSCI_RING_H
+
+/*
+ * Bounded lock-free ring for one producer thread and one consumer thread.
+ * Each index is written by one side only and published with release
+ * ordering, so neither side ever waits for the other.
+ */
+
+#include <vector>
+
+#include <stddef.h>
+
+template<class T>
+class spsc_ring {
+public:
+	// One slot stays empty to tell a full ring from an empty one
+	explicit spsc_ring(size_t capacity) : buf_(capacity + 1), head_(0), tail_(0) {}
+
+	size_t capacity() const { return buf_.size() - 1; }
+
+	// Producer side; false if the ring is full
+	bool push(const T &item) {
+		size_t head = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+		size_t next = (head + 1 == buf_.size()) ? 0 : head + 1;
+
+		if(next == __atomic_load_n(&tail_, __ATOMIC_ACQUIRE))
+			return false;
+
+		buf_[head] = item;
+		__atomic_store_n(&head_, next, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// Consumer side; false if the ring is empty
+	bool pop(T &item) {
+		size_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+
+		if(tail == __atomic_load_n(&head_, __ATOMIC_ACQUIRE))
+			return false;
+
+		item = buf_[tail];
+		__atomic_store_n(&tail_, (tail + 1 == buf_.size()) ? 0 : tail + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+private:
+	spsc_ring(const spsc_ring &);
+	spsc_ring &operator=(const spsc_ring &);
+
+	std::vector<T> buf_;
+
+	// On separate cache lines, so the two threads do not keep stealing
+	// the line from each other
+	char pad0_[64];
+	size_t head_;       // Next slot to write, owned by the producer
+	char pad1_[64];
+	size_t tail_;       // Next slot to read, owned by the consumer
+	char pad2_[64];
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef ATSCI_RT_H
+#define ATSCI_RT_H
+
+/*
+ * Real-time mode and timing measurement for the sampler. rt_setup() locks
+ * the process in memory and moves it to SCHED_FIFO, and rt_pin_cpu() keeps
+ * it on one CPU; the sampler then sleeps to absolute deadlines and records how late
+ * each wakeup was in a jitter histogram.
+ */
+
+#include <iostream>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// Stack touched in advance, so page faults do not hit the sample path
+#define RT_STACK_PREFAULT (256 * 1024)
+
+inline void rt_prefault_stack() {
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	for(size_t i=0; i<sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+inline int rt_pin_cpu(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if(sched_setaffinity(0, sizeof(set), &set) != 0) {
+		perror("sched_setaffinity");
+		std::cerr << "Unable to pin the sampler to CPU " << cpu << "." << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+inline int rt_setup(int priority) {
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		perror("mlockall");
+		std::cerr << "Unable to lock the sampler in memory." << std::endl;
+		return 1;
+	}
+
+	rt_prefault_stack();
+
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	if(sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+		perror("sched_setscheduler");
+		std::cerr << "Unable to set real-time priority " << priority << "." << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Sleeps until the CLOCK_MONOTONIC time t; returns how late it woke up,
+// in seconds
+inline double rt_sleep_until(double t) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts.tv_sec) + (now.tv_nsec - ts.tv_nsec) / 1e9;
+}
+
+/*
+ * Wakeup lateness in buckets with upper bounds of 10, 20, 50, 100, ...
+ * microseconds; the last bucket takes everything from half a second up.
+ */
+#define JITTER_BUCKETS 16
+
+struct jitter_hist {
+	long counts[JITTER_BUCKETS];
+	long total;
+	double sum;
+	double max;
+};
+
+inline long jitter_bound_us(int bucket) {
+	static const long steps[] = { 1, 2, 5 };
+	long bound = 10;
+	for(int i=0; i<bucket/3; i++)
+		bound *= 10;
+
+	return bound * steps[bucket % 3];
+}
+
+inline void jitter_init(jitter_hist &h) {
+	memset(h.counts, 0, sizeof(h.counts));
+	h.total = 0;
+	h.sum = 0;
+	h.max = 0;
+}
+
+inline void jitter_add(jitter_hist &h, double late) {
+	if(late < 0) late = 0;
+
+	int bucket = 0;
+	while(bucket < JITTER_BUCKETS - 1 && late * 1e6 >= jitter_bound_us(bucket))
+		bucket++;
+
+	h.counts[bucket]++;
+	h.total++;
+	h.sum += late;
+	if(late > h.max) h.max = late;
+}
+
+// "jitter <upper bound in us> <count>" for each non-empty bucket, then
+// "jitter summary <wakeups> <mean us> <max us>", through out
+inline void jitter_print(const jitter_hist &h, int (*out)(const char *, ...) = printf) {
+	for(int i=0; i<JITTER_BUCKETS; i++) {
+		if(!h.counts[i])
+			continue;
+
+		if(i == JITTER_BUCKETS - 1) out("jitter inf %ld\n", h.counts[i]);
+		else out("jitter %ld %ld\n", jitter_bound_us(i), h.counts[i]);
+	}
+
+	out("jitter summary %ld %.1f %.1f\n", h.total, h.total ? h.sum / h.total * 1e6 : 0.0, h.max * 1e6);
+}
+
+#endif
@@ -0,0 +1,5 @@
+#include "atsci_cli.h"
+
+int main(int argc, char **argv) {
+	return ezo_main<rtd_traits>(argc, argv);
+}
@@ -0,0 +1,54 @@
+#ifndef ATSCI_RTD_H
+#define ATSCI_RTD_H
+
+/*
+ * Temperature compensation straight from an EZO RTD circuit on the same
+ * bus, shared by the tools and the sampler.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+#include "atsci_ezo.h"
+#include "atsci_state.h"
+#include "atsci_traits.h"
+
+/*
+ * Parses a temperature argument: a number in Celsius, or "rtd" or
+ * "rtd:<address>" to measure it with an RTD circuit on the bus. A reading
+ * of the RTD circuit no older than max_age seconds is reused.
+ */
+inline int temp_from_arg(const std::string &bus, const std::string &arg, double max_age, float *temp) {
+	if(arg.compare(0, 3, "rtd") != 0) {
+		if(sscanf(arg.c_str(), "%f", temp) != 1) {
+			diag() << "Invalid floating point as temperature: " << arg << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	int addr = rtd_traits::addr;
+	if(arg != "rtd" && (arg[3] != ':' || sscanf(arg.c_str() + 4, "%i", &addr) != 1)) {
+		diag() << "Invalid RTD circuit: " << arg << std::endl;
+		return 1;
+	}
+
+	if(cache_lookup(bus, addr, "T", "-", max_age, temp) == 0)
+		return 0;
+
+	ezo_driver<rtd_traits> rtd(bus, addr);
+	std::vector<std::string> names(1, "T");
+	std::vector<float> values;
+
+	if(rtd.open() != 0 || rtd.check_format() != 0 || rtd.measure(names, values) != 0)
+		return 1;
+
+	*temp = values[0];
+	return 0;
+}
+
+#endif
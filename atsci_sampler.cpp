@@ -0,0 +1,1632 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+
+#include "atsci_alarm.h"
+#include "atsci_duty.h"
+#include "atsci_ezo.h"
+#include "atsci_filter.h"
+#include "atsci_fleet.h"
+#include "atsci_health.h"
+#include "atsci_metrics.h"
+#include "atsci_mqtt.h"
+#include "atsci_output.h"
+#include "atsci_rt.h"
+#include "atsci_i2c.h"
+#include "atsci_state.h"
+#include "atsci_time.h"
+#include "atsci_sched.h"
+#include "atsci_shadow.h"
+
+void usage() {
+	std::cout <<	"Atlas Scientific EZO class sensor sampler\n"
+			"Author: Jaakko Salo (jaakkos@gmail.com)\n"
+			"\n"
+			"Usage: atsci_sampler <device> [options] [<probe> ...]\n"
+			"\n"
+			"Device is the Linux device node, like /dev/i2c-2. Probe is a circuit\n"
+			"type (ph, ec, do or rtd), optionally followed by its I2C address, like\n"
+			"ec:0x64, and by @<mux address>:<channel> if behind an I2C multiplexer,\n"
+			"like ph@0x70:3. All probes are assumed to be in the same water, so pH\n"
+			"and DO conversions are scheduled around the interference caused by EC.\n"
+			"Transactions due at the same time are grouped by mux channel.\n"
+			"\n"
+			"A probe can be followed by a chain of filters for its readings, like\n"
+			"ph,median=5,ewma=0.3, applied in the given order:\n"
+			"\n"
+			"   median=<n>         Median of the last n readings\n"
+			"   ewma=<alpha>       Exponentially weighted moving average, with\n"
+			"                      alpha (0..1] the weight of the new reading\n"
+			"   kalman=<q>:<r>     1-D Kalman filter for a slowly drifting level,\n"
+			"                      with q the drift and r the measurement noise\n"
+			"                      variance per reading\n"
+			"\n"
+			"With -a, a probe can also be given deadband=<d> and rate=<r>, like\n"
+			"ec,deadband=20,rate=5. While its readings stay within d of the reading\n"
+			"the deadband was last set at, it is converted every 2nd, 4th, ... cycle,\n"
+			"up to the maximum interval. When a reading leaves the deadband, or\n"
+			"changes faster than r per second, it is converted every cycle again.\n"
+			"Only the first parameter of a circuit is watched.\n"
+			"\n"
+			"Options:\n"
+			"\n"
+			"   -i <seconds>       Start a new cycle every <seconds>. By default the\n"
+			"                      cycles run back to back.\n"
+			"   -n <count>         Stop after count cycles.\n"
+			"   -p                 Print the cycle plan and exit.\n"
+			"   -f <file>          Also sample the probes listed in file, one per\n"
+			"                      line, like the one written by addr fleet of the\n"
+			"                      atsci_<type> tools. Lines starting with # are\n"
+			"                      skipped.\n"
+			"   -t <T>|rtd[:<addr>]|<file>[:<div>]\n"
+			"                      Temperature for the compensation of all probes:\n"
+			"                      a constant in Celsius, an EZO RTD circuit measured\n"
+			"                      at the start of every cycle (no need to list it as\n"
+			"                      a probe), or a file to read it from every cycle,\n"
+			"                      with the value divided by div (use 1000 for a\n"
+			"                      1-Wire sensor's temperature file).\n"
+			"   -E                 Do not feed the EC reading into the salinity\n"
+			"                      compensation of DO probes.\n"
+			"   -c [<reg>=]<tolerance>[%]\n"
+			"                      Skip writes of the compensation register reg (T\n"
+			"                      or S, T if not given) that change the value by at\n"
+			"                      most tolerance, or by at most that percentage of\n"
+			"                      the value with %. Defaults: T=0.05 (Celsius) and\n"
+			"                      S=1% (of the EC reading). Can be repeated.\n"
+			"   -a <seconds>       Adapt the rate of probes with a deadband, down to\n"
+			"                      one conversion every <seconds>. Without -i, a\n"
+			"                      cycle takes as long as one with all the probes.\n"
+			"   -R <priority>      Run with SCHED_FIFO real-time priority (1-99),\n"
+			"                      locked in memory. Needs root or CAP_SYS_NICE.\n"
+			"   -A <cpu>           Pin the sampler to the given CPU.\n"
+			"   -T                 Print the measurement window of each reading\n"
+			"                      before its values, as\n"
+			"                         <probe> time <R mono> <R real> <reply mono>\n"
+			"                         <reply real> <mid mono> <mid real>\n"
+			"                      with the CLOCK_MONOTONIC and CLOCK_REALTIME\n"
+			"                      times in seconds at which the R command was\n"
+			"                      sent, the reading was read back, and the middle\n"
+			"                      of that window.\n"
+			"   -o <file>          Also append the output to file, synced to disk\n"
+			"                      after every batch of lines.\n"
+			"   -M <host>[:<port>] Also publish the output to an MQTT broker, each\n"
+			"                      line \"<a> <b> <rest>\" to the topic <prefix>/<a>/<b>.\n"
+			"                      While the broker is away, up to -B messages are\n"
+			"                      kept for it.\n"
+			"   -P <prefix>        Topic prefix for -M (default atsci).\n"
+			"   -Q 0|1             QoS of the messages for -M (default 0).\n"
+			"   -B <lines>         Lines buffered for each output (default 4096).\n"
+			"   -O drop|block      When an output falls that far behind, drop the\n"
+			"                      new lines (the default; the output then gets a\n"
+			"                      \"dropped <total>\" line) or make the sampler wait.\n"
+			"   -S                 Put each probe to sleep after its reading, and wake\n"
+			"                      it ahead of its next conversion, by the time it\n"
+			"                      has been seen to take to wake up. Needs -i.\n"
+			"   -L <file>          Check every reading against the alarm rules in\n"
+			"                      file, one per line:\n"
+			"                         <name> <probe> <parameter> <condition>\n"
+			"                            [hyst=<h>] [hold=<s>] [notify=<socket>]\n"
+			"                            [exec=<command ...>]\n"
+			"                      with the probe a label like ph:0x63 or a type,\n"
+			"                      and the condition > <value>, < <value> or\n"
+			"                      rate> <value per second>. See README.md.\n"
+			"   -H [<host>:]<port>|<path>\n"
+			"                      Serve OpenMetrics on the TCP port (on localhost\n"
+			"                      unless a host is given) or on the Unix socket\n"
+			"                      at path, from what the sampler has measured.\n"
+			"                      STATUS is then queried from each probe every\n"
+			"                      minute for its VCC and restart reason.\n"
+			"   -W <file>          Save the state of the probes (filters, adaptive\n"
+			"                      rate, wake-up latency, alarms, last reading) to\n"
+			"                      file every minute and at exit, and carry on from\n"
+			"                      it at start. A circuit whose STATUS restart\n"
+			"                      reason is unchanged is not set up again.\n"
+			"   -j                 Measure how late the sampler wakes up for each\n"
+			"                      scheduled conversion, and print a histogram when\n"
+			"                      it stops (after -n cycles, or on SIGINT/SIGTERM):\n"
+			"                         jitter <upper bound in us> <count>\n"
+			"                         jitter summary <wakeups> <mean us> <max us>\n"
+			"\n"
+			"Each reading is printed on its own line as: <probe> <parameter> <value>\n"
+			"For probes with filters, the filtered value follows the raw one.\n"
+			"\n"
+			"A probe that fails is reopened and tried again in the next cycle. After\n"
+			"3 failed cycles in a row it is left out of the cycles for 5 seconds,\n"
+			"doubling up to 5 minutes for every failed retry. Changes in the health\n"
+			"of a probe are printed as:\n"
+			"\n"
+			"   <probe> health <ok|failing|quarantined> <failures> <retry in seconds>\n"
+			"\n"
+			"Compensation is pushed to the circuits every cycle before they measure:\n"
+			"temperature to all of them, and the reading of the first EC probe to\n"
+			"the DO probes, which are then converted after the EC interference is\n"
+			"over. Values the circuit already has are not written again.\n"
+			"\n";
+
+	exit(1);
+}
+
+// Attempts of a transaction in a cycle, and the delay between them
+#define SAMPLER_RETRIES 3
+#define SAMPLER_RETRY_US 50000
+
+struct probe {
+	std::string label;
+	std::string bus;    // With the mux channel, if behind one
+	int channel;        // Mux address * 8 + channel, -1 if not behind a mux
+	const probe_type *type;
+	int addr;
+	ezo_device *drv;   // Closed while failing
+	bool pending;
+	bool after_ec;  // Waits for the EC reading for its compensation
+	filter_chain filter;
+	std::vector<filter_chain> filters;  // State of the chain, per parameter
+
+	// Adaptive rate: converted every `every` cycles, at most max_every
+	float deadband;    // Negative to convert every cycle
+	float max_rate;    // Per second, negative if not watched
+	long every;
+	long max_every;
+	long next_cycle;
+	bool due;          // Converted in the current cycle
+	bool have_ref;
+	float ref;         // Reading the deadband is centered at
+	float last;
+	double last_t;
+
+	device_health health;
+	bool failed;       // In the current cycle
+
+	std::vector<float> readings;
+	sample_window window;
+
+	std::vector<alarm_state> alarms;
+
+	char reason;       // Restart reason from STATUS at setup, with -W
+
+	size_t metrics;    // Index in the metrics store
+	double status_t;   // When STATUS was last planned for it
+	bool status_pending;
+
+	// Duty cycling
+	bool asleep;
+	bool waking;
+	double asleep_since;
+	double asleep_total;
+	double wake_sent;  // First wake-up command
+	bool wake_heard;   // Awake, processing the wake-up command
+	wake_latency wake;
+};
+
+struct temp_source {
+	std::string path;  // Empty for a constant or an RTD circuit
+	float divisor;
+	int rtd_addr;      // -1 unless measured with an RTD circuit
+	ezo_driver<rtd_traits> *rtd;
+	float value;
+};
+
+// How much a compensation value may change without being written
+struct comp_tolerance {
+	float value;
+	bool relative;     // A percentage of the value
+};
+
+struct comp_config {
+	bool have_temp;
+	temp_source temp;
+	int ec_probe;      // Index of the probe feeding DO, -1 if none
+	comp_tolerance temp_tol;
+	comp_tolerance sal_tol;
+};
+
+float comp_tol(const comp_tolerance &tol, float value) {
+	return tol.relative ? fabs(value) * tol.value / 100 : tol.value;
+}
+
+// Parses "[<reg>=]<tolerance>[%]" into the tolerance of T or S
+int parse_comp_tol(const std::string &arg, comp_config &comp) {
+	std::string reg = "T", value = arg;
+
+	size_t eq = arg.find('=');
+	if(eq != std::string::npos) {
+		reg = arg.substr(0, eq);
+		value = arg.substr(eq + 1);
+	}
+
+	comp_tolerance tol;
+	char *end;
+	tol.value = strtof(value.c_str(), &end);
+	tol.relative = (*end == '%');
+
+	if(end == value.c_str() || *(end + tol.relative) != '\0' || tol.value < 0)
+		return 1;
+
+	if(reg == "T") comp.temp_tol = tol;
+	else if(reg == "S") comp.sal_tol = tol;
+	else return 1;
+
+	return 0;
+}
+
+double mono_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Wakeup lateness, collected with -j
+jitter_hist *jitter = NULL;
+
+void sleep_until(double t) {
+	double late = rt_sleep_until(t);
+	if(jitter) jitter_add(*jitter, late);
+}
+
+// What the metrics server serves, with -H
+metrics_store *metrics = NULL;
+metrics_server *metrics_srv = NULL;
+
+// STATUS is queried this often for the metrics
+#define METRICS_STATUS_S 60
+
+// Where the state of the probes is saved, with -W
+std::string snapshot_path;
+#define SAMPLER_SNAPSHOT_S 60
+
+// Print the measurement window of each reading, with -T
+bool timestamps = false;
+
+// The cycle interval with -S, which has the probes sleep in between
+double duty_interval = 0;
+
+// Where the lines go, each drained by its own writer thread
+std::vector<output_sink *> sinks;
+
+// Room for diagnostics and file writes not written out yet
+#define SAMPLER_DIAG_LINES 256
+#define SAMPLER_FILE_JOBS 256
+
+// Queues a line for all the sinks, without waiting for any I/O
+int emit(const char *fmt, ...) {
+	output_line line;
+
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(line.text, sizeof(line.text), fmt, ap);
+	va_end(ap);
+
+	// A cut line still ends the record, like in sink_streambuf
+	if(len >= (int)sizeof(line.text))
+		line.text[sizeof(line.text) - 2] = '\n';
+
+	for(size_t i=0; i<sinks.size(); i++)
+		sinks[i]->push(line);
+
+	return len;
+}
+
+// The diagnostics of the measuring thread go to stderr through a sink of
+// their own, and the state entries and the snapshot to a file writer, so
+// it never waits for a write itself
+output_sink *diag_sink = NULL;
+file_writer *files = NULL;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+	stop_requested = 1;
+}
+
+std::vector<std::string> split(const std::string &s, char sep) {
+	std::vector<std::string> out;
+	std::istringstream in(s);
+	std::string item;
+
+	while(std::getline(in, item, sep))
+		if(!item.empty())
+			out.push_back(item);
+
+	return out;
+}
+
+int parse_probe(const std::string &spec, probe &p) {
+	std::vector<std::string> parts = split(spec, ',');
+	if(parts.empty()) {
+		std::cerr << "Invalid probe: " << spec << std::endl;
+		return 1;
+	}
+
+	probe_place place;
+	if(parse_probe_place(spec, place) != 0)
+		return 1;
+
+	p.type = place.type;
+	p.addr = place.addr;
+	p.channel = (place.mux < 0) ? -1 : place.mux * 8 + place.channel;
+
+	p.filter.clear();
+	p.deadband = -1;
+	p.max_rate = -1;
+
+	for(size_t i=1; i<parts.size(); i++) {
+		char c;
+		if(sscanf(parts[i].c_str(), "deadband=%f%c", &p.deadband, &c) == 1 && p.deadband >= 0)
+			continue;
+
+		if(sscanf(parts[i].c_str(), "rate=%f%c", &p.max_rate, &c) == 1 && p.max_rate >= 0)
+			continue;
+
+		filter_stage f;
+		if(parse_filter_stage(parts[i], f) != 0) {
+			std::cerr << "Invalid filter in probe: " << parts[i] << std::endl;
+			return 1;
+		}
+
+		p.filter.push_back(f);
+	}
+
+	char label[32];
+	snprintf(label, sizeof(label), "%s:0x%02x", p.type->name, p.addr);
+	p.label = label + place.route;
+	p.bus = place.route;  // Completed with the bus in main()
+	p.drv = NULL;         // Made in main(), with the bus
+	p.pending = false;
+	p.status_pending = false;
+	p.after_ec = false;
+
+	size_t nparams = 0;
+	for(const char *const *n = p.type->params; *n; n++)
+		nparams++;
+
+	p.filters.assign(nparams, p.filter);
+	p.readings.reserve(nparams);
+
+	p.every = 1;
+	p.max_every = 1;
+	p.next_cycle = 0;
+	p.due = true;
+	p.have_ref = false;
+	p.ref = 0;
+	p.last = 0;
+	p.last_t = 0;
+
+	health_init(p.health);
+	p.failed = false;
+
+	p.reason = 0;
+
+	p.asleep = false;
+	p.waking = false;
+	p.wake_heard = false;
+	p.asleep_total = 0;
+	wake_init(p.wake);
+	return 0;
+}
+
+int parse_temp_source(const std::string &spec, temp_source &src) {
+	char *end;
+	src.value = strtof(spec.c_str(), &end);
+	src.divisor = 1;
+	src.path = "";
+	src.rtd_addr = -1;
+	src.rtd = NULL;
+
+	if(!spec.empty() && *end == '\0')
+		return 0;
+
+	if(spec.compare(0, 3, "rtd") == 0) {
+		src.rtd_addr = rtd_traits::addr;
+		if(spec != "rtd" && (spec[3] != ':' || sscanf(spec.c_str() + 4, "%i", &src.rtd_addr) != 1))
+			return 1;
+
+		return 0;
+	}
+
+	src.path = spec;
+	size_t colon = spec.rfind(':');
+	if(colon != std::string::npos && sscanf(spec.c_str() + colon + 1, "%f", &src.divisor) == 1) {
+		src.path = spec.substr(0, colon);
+		if(src.divisor == 0) return 1;
+	}
+
+	return 0;
+}
+
+int read_temp_source(temp_source &src) {
+	if(src.rtd_addr >= 0) {
+		std::vector<std::string> names(1, "T");
+		std::vector<float> values;
+
+		if(src.rtd->measure(names, values) != 0)
+			return 1;
+
+		src.value = values[0];
+
+		emit("rtd:0x%02x T %g\n", src.rtd_addr, src.value);
+		return 0;
+	}
+
+	if(src.path.empty())
+		return 0;
+
+	FILE *f = fopen(src.path.c_str(), "r");
+	float value;
+
+	if(!f || fscanf(f, "%f", &value) != 1) {
+		diag() << "Unable to read the temperature from " << src.path << std::endl;
+		if(f) fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+	src.value = value / src.divisor;
+	emit("temp T %g\n", src.value);
+	return 0;
+}
+
+int init_probe(probe &p) {
+	if(p.drv->open() != 0)
+		return 1;
+
+	// A circuit that has not restarted since its format was checked still
+	// has it. The first command only wakes a sleeping circuit, so STATUS
+	// is tried twice.
+	if(!snapshot_path.empty()) {
+		char reason;
+		bool known = (query_restart_reason(p.drv->fd(), &reason, p.type->bufsize) == 0 ||
+		              query_restart_reason(p.drv->fd(), &reason, p.type->bufsize) == 0);
+
+		p.asleep = false;
+
+		if(known && p.reason && reason == p.reason)
+			return 0;
+
+		p.reason = known ? reason : 0;
+	}
+
+	if(p.drv->check_format() != 0) {
+		p.drv->close();
+		return 1;
+	}
+
+	return 0;
+}
+
+// Updates the circuit breaker of a probe after a cycle, reopening a failed
+// one the next time it is tried
+void record_health(probe &p, bool ok, double now) {
+	bool changed;
+
+	if(ok) changed = health_ok(p.health);
+	else {
+		changed = health_fail(p.health, now);
+		p.drv->close();
+	}
+
+	if(metrics)
+		metrics->health(p.metrics, health_name(p.health.state), p.health.failures, p.health.total_ok,
+		                p.health.total_failed);
+
+	if(!changed)
+		return;
+
+	double retry = (p.health.state == HEALTH_QUARANTINED) ? p.health.retry_at - now : 0;
+	emit("%s health %s %d %g\n", p.label.c_str(), health_name(p.health.state), p.health.failures, retry);
+}
+
+bool accepts_comp(const probe &p, const char *reg) {
+	for(const ezo_reg *r = p.type->regs; r->op; r++)
+		if(std::string(r->cmd) == reg)
+			return true;
+
+	return false;
+}
+
+// Starts a conversion, retrying the R command a busy circuit may not have
+// taken
+int start_retry(probe &p) {
+	for(int i=1; p.drv->send_read() != 0; i++) {
+		if(i == SAMPLER_RETRIES)
+			return 1;
+
+		usleep(SAMPLER_RETRY_US);
+	}
+
+	return 0;
+}
+
+// Checks the rules on a parameter of the reading just fetched, with the
+// filtered value if the probe has filters, and runs the hooks of the
+// alarms raised or cleared
+void check_alarms(probe &p, size_t param, float value) {
+	const struct timespec &t = p.window.reply.mono;
+
+	for(size_t i=0; i<p.alarms.size(); i++) {
+		alarm_state &a = p.alarms[i];
+		if(a.param != param)
+			continue;
+
+		alarm_change change = alarm_update(a, value, t.tv_sec + t.tv_nsec / 1e9);
+		if(change == ALARM_NONE)
+			continue;
+
+		const alarm_rule &r = *a.rule;
+		const char *state = (change == ALARM_RAISED) ? "raised" : "cleared";
+		const char *name = p.type->params[param];
+
+		char line[OUTPUT_LINE_MAX];
+		snprintf(line, sizeof(line), "%s alarm %s %s %s %g\n", p.label.c_str(), r.name.c_str(), state, name, value);
+
+		int err;
+		if(!r.notify.empty() && (err = alarm_notify(r.notify, line)) != 0)
+			diag() << "Unable to notify " << r.notify << ": " << strerror(err) << std::endl;
+
+		if(!r.exec.empty() && (err = alarm_exec(r.exec, r.name, state, p.label, name, value)) != 0)
+			diag() << "Unable to run " << r.exec << ": " << strerror(err) << std::endl;
+
+		emit("%s", line);
+	}
+}
+
+// Sets up the alarms of the rules on the probes they name
+int attach_alarms(std::vector<probe> &probes, const std::vector<alarm_rule> &rules) {
+	for(size_t i=0; i<rules.size(); i++) {
+		bool found = false;
+
+		for(size_t j=0; j<probes.size(); j++) {
+			probe &p = probes[j];
+			if(rules[i].probe != p.label && rules[i].probe != p.type->name)
+				continue;
+
+			size_t param = 0;
+			while(p.type->params[param] && rules[i].param != p.type->params[param])
+				param++;
+
+			if(!p.type->params[param]) {
+				std::cerr << "Alarm " << rules[i].name << ": " << p.label << " has no parameter "
+				          << rules[i].param << "." << std::endl;
+				return 1;
+			}
+
+			alarm_state a;
+			alarm_init(a, &rules[i], param);
+			p.alarms.push_back(a);
+			found = true;
+		}
+
+		if(!found) {
+			std::cerr << "Alarm " << rules[i].name << ": no probe " << rules[i].probe << "." << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the reading into p.readings, which has room for all of them. The
+ * reply goes to the buffer of the driver and is parsed in place; only the
+ * entries queued for the result cache are allocated.
+ */
+int fetch_reading(probe &p) {
+	std::vector<float> &readings = p.readings;
+	readings.resize(p.filters.size());
+
+	// The reading may still be pending if the circuit was slow to start
+	double t = mono_now();
+	int status;
+	for(int i=1; (status = p.drv->fetch_values(&readings[0], readings.size())) != 0; i++) {
+		if(i == SAMPLER_RETRIES || status == 2) {
+			readings.clear();
+			return 1;
+		}
+
+		usleep(SAMPLER_RETRY_US);
+	}
+
+	p.window = p.drv->window();
+
+	// For read --max-age of the tools; written out by the file writer
+	p.drv->cache_values(&readings[0], readings.size());
+
+	if(metrics)
+		metrics->latency(p.metrics, METRICS_READ, mono_now() - t);
+
+	return 0;
+}
+
+// Filters and prints the reading just fetched, and checks its alarms
+void publish_reading(probe &p) {
+	const std::vector<float> &readings = p.readings;
+
+	if(timestamps) {
+		output_line line;
+		emit("%s", format_window(line.text, sizeof(line.text), p.label.c_str(), p.window));
+	}
+
+	for(size_t i=0; i<readings.size(); i++) {
+		const char *name = p.type->params[i];
+		float value = readings[i];
+
+		if(p.filter.empty())
+			emit("%s %s %g\n", p.label.c_str(), name, value);
+		else {
+			value = filter_chain_update(p.filters[i], readings[i]);
+			emit("%s %s %g %g\n", p.label.c_str(), name, readings[i], value);
+		}
+
+		if(metrics)
+			metrics->reading(p.metrics, i, readings[i], value, p.window.reply.real);
+
+		check_alarms(p, i, value);
+	}
+}
+
+// Slows a probe down while its readings stay in the deadband
+void adapt_rate(probe &p, float value, double now) {
+	if(p.deadband < 0)
+		return;
+
+	bool fast = !p.have_ref || fabs(value - p.ref) > p.deadband;
+
+	if(p.have_ref && p.max_rate >= 0 && now > p.last_t && fabs(value - p.last) / (now - p.last_t) > p.max_rate)
+		fast = true;
+
+	if(fast) {
+		p.ref = value;
+		p.every = 1;
+	}
+
+	else p.every = std::min(p.every * 2, p.max_every);
+
+	p.have_ref = true;
+	p.last = value;
+	p.last_t = now;
+}
+
+struct cycle_event {
+	long t_us;
+	size_t slot;
+	bool fetch;
+
+	bool operator<(const cycle_event &o) const {
+		if(t_us != o.t_us) return t_us < o.t_us;
+		if(fetch != o.fetch) return fetch; // Free up a probe before starting the next one
+		return slot < o.slot;
+	}
+};
+
+/*
+ * What the cycles keep from one to the next, and the room they work in:
+ * allocated for the first cycles and only cleared after that, so the
+ * sample path does not allocate.
+ */
+struct cycle_state {
+	// plan_due()
+	std::vector<const probe_type *> types;
+	std::vector<bool> after;
+	std::vector<bool> status;
+	std::vector<size_t> index;
+
+	// run_cycle()
+	std::vector<cycle_event> events;
+	std::vector<bool> has_status;
+	std::vector<size_t> order;
+	int channel;  // The mux channel selected last, -1 if none yet
+
+	// wake_probes()
+	std::vector<std::pair<double, size_t> > wake_order;
+
+	cycle_state() : channel(-1) {}
+};
+
+/*
+ * Plans the cycle for the probes due in cycle n. A probe waiting for the EC
+ * reading is converted with the others when the EC probe is not due. For
+ * the metrics, STATUS is queried every METRICS_STATUS_S in a slot of the
+ * cycle.
+ */
+void plan_due(std::vector<probe> &probes, const comp_config &comp, long n, std::vector<sched_slot> &plan,
+              cycle_state &cs) {
+	std::vector<const probe_type *> &types = cs.types;
+	std::vector<bool> &after = cs.after;
+	std::vector<bool> &status = cs.status;
+	std::vector<size_t> &index = cs.index;
+
+	types.clear();
+	after.clear();
+	status.clear();
+	index.clear();
+
+	bool ec_due = (comp.ec_probe >= 0 && probes[comp.ec_probe].next_cycle <= n);
+
+	double now = mono_now();
+
+	for(size_t i=0; i<probes.size(); i++) {
+		probes[i].due = (probes[i].next_cycle <= n && probes[i].drv->fd() >= 0 && health_available(probes[i].health, now));
+		probes[i].failed = false;
+		if(!probes[i].due)
+			continue;
+
+		types.push_back(probes[i].type);
+		after.push_back(probes[i].after_ec && ec_due);
+		status.push_back(metrics && now - probes[i].status_t >= METRICS_STATUS_S);
+		index.push_back(i);
+
+		if(status.back())
+			probes[i].status_t = now;
+	}
+
+	plan_cycle(types, after, plan, &status);
+
+	for(size_t i=0; i<plan.size(); i++)
+		plan[i].probe = index[plan[i].probe];
+}
+
+// Puts events for the channel the mux is on first, then the rest by channel
+struct channel_order {
+	int current;
+
+	int key(int channel) const {
+		if(channel < 0) return -2;   // Not behind a mux
+		if(channel == current) return -1;
+		return channel;
+	}
+
+	bool operator()(int a, int b) const { return key(a) < key(b); }
+};
+
+// Ties go by index, which keeps the order std::sort leaves them in fixed
+// without the buffer std::stable_sort allocates
+struct probe_channel_order {
+	channel_order order;
+	const std::vector<probe> *probes;
+
+	bool operator()(size_t a, size_t b) const {
+		int ca = (*probes)[a].channel, cb = (*probes)[b].channel;
+		return order(ca, cb) || (!order(cb, ca) && a < b);
+	}
+};
+
+struct event_channel_order {
+	channel_order order;
+	const std::vector<probe> *probes;
+	const std::vector<sched_slot> *plan;
+
+	int channel(const cycle_event &e) const { return (*probes)[(*plan)[e.slot].probe].channel; }
+
+	bool operator()(const cycle_event &a, const cycle_event &b) const {
+		return order(channel(a), channel(b)) || (!order(channel(b), channel(a)) && a.slot < b.slot);
+	}
+};
+
+/*
+ * Orders each run of events due at the same time by mux channel, starting
+ * with the channel the mux is already on, so it is switched at most once
+ * per channel in the run. *current is the channel selected last.
+ */
+void group_by_channel(std::vector<cycle_event> &events, const std::vector<probe> &probes,
+                      const std::vector<sched_slot> &plan, int *current) {
+	for(size_t i=0; i<events.size(); ) {
+		size_t j = i + 1;
+		while(j < events.size() && events[j].t_us == events[i].t_us && events[j].fetch == events[i].fetch)
+			j++;
+
+		event_channel_order cmp = { { *current }, &probes, &plan };
+		std::sort(events.begin() + i, events.begin() + j, cmp);
+
+		for(size_t k=i; k<j; k++)
+			if(cmp.channel(events[k]) >= 0)
+				*current = cmp.channel(events[k]);
+
+		i = j;
+	}
+}
+
+int sleep_probe(probe &p, double now) {
+	if(p.drv->sleep() != 0)
+		return 1;
+
+	p.asleep = true;
+	p.asleep_since = now;
+	return 0;
+}
+
+// Puts a probe to sleep after its last transaction in the cycle that
+// started at start, unless it would have to be woken right away
+void sleep_after(probe &p, double start) {
+	double now = mono_now();
+
+	if(duty_interval > 0 && !p.failed && start + duty_interval * p.every - now > wake_lead(p.wake))
+		sleep_probe(p, now);
+}
+
+int run_cycle(const std::string &bus, std::vector<probe> &probes, const std::vector<sched_slot> &plan,
+              comp_config &comp, double start, cycle_state &cs) {
+	std::vector<cycle_event> &events = cs.events;
+	std::vector<bool> &has_status = cs.has_status;
+	int &current = cs.channel;
+
+	events.clear();
+	has_status.assign(probes.size(), false);
+
+	for(size_t i=0; i<plan.size(); i++) {
+		if(plan[i].op == SLOT_STATUS)
+			has_status[plan[i].probe] = true;
+
+		cycle_event start = { plan[i].start_us, i, false };
+		cycle_event fetch = { plan[i].end_us, i, true };
+		events.push_back(start);
+		events.push_back(fetch);
+	}
+
+	std::sort(events.begin(), events.end());
+
+	// The compensation goes out before the conversions, also by channel
+	std::vector<size_t> &order = cs.order;
+	order.clear();
+	for(size_t i=0; i<probes.size(); i++)
+		order.push_back(i);
+
+	probe_channel_order cmp = { { current }, &probes };
+	std::sort(order.begin(), order.end(), cmp);
+
+	int failed = 0;
+
+	if(comp.have_temp) {
+		if(read_temp_source(comp.temp) != 0)
+			failed++;
+
+		else for(size_t k=0; k<order.size(); k++) {
+			size_t i = order[k];
+			if(!probes[i].due || !accepts_comp(probes[i], "T"))
+				continue;
+
+			if(probes[i].drv->set_reg("T", comp.temp.value, comp_tol(comp.temp_tol, comp.temp.value)) != 0) {
+				probes[i].failed = true;
+				failed++;
+			}
+
+			if(probes[i].channel >= 0)
+				current = probes[i].channel;
+		}
+	}
+
+	group_by_channel(events, probes, plan, &current);
+
+	quiet_wait(bus);
+	double t0 = mono_now();
+
+	for(size_t i=0; i<events.size(); i++) {
+		int idx = plan[events[i].slot].probe;
+		probe &p = probes[idx];
+		sleep_until(t0 + events[i].t_us / 1e6);
+
+		if(plan[events[i].slot].op == SLOT_STATUS) {
+			char reason;
+			float vcc;
+
+			if(!events[i].fetch)
+				p.status_pending = !p.failed && p.drv->send_status() == 0;
+
+			else {
+				if(p.status_pending && p.drv->read_status(&reason, &vcc) == 0)
+					metrics->status(p.metrics, reason, vcc);
+
+				p.status_pending = false;
+				sleep_after(p, start);
+			}
+
+			continue;
+		}
+
+		if(!events[i].fetch) {
+			double t = mono_now();
+			p.pending = (start_retry(p) == 0);
+
+			if(metrics)
+				metrics->latency(p.metrics, METRICS_WRITE, mono_now() - t);
+
+			if(!p.pending) {
+				p.failed = true;
+				failed++;
+			}
+
+			continue;
+		}
+
+		if(!p.pending)
+			continue;
+
+		p.pending = false;
+
+		// Which also starts the quiet period of an EC probe
+		if(fetch_reading(p) != 0) {
+			p.every = 1;
+			p.failed = true;
+			failed++;
+			continue;
+		}
+
+		publish_reading(p);
+
+		adapt_rate(p, p.readings[0], mono_now());
+
+		if(!has_status[idx])
+			sleep_after(p, start);
+
+		if(idx != comp.ec_probe)
+			continue;
+
+		// Salinity compensation for the DO probes converted after this
+		float tol = comp_tol(comp.sal_tol, p.readings[0]);
+		for(size_t j=0; j<probes.size(); j++)
+			if(probes[j].after_ec && probes[j].due && probes[j].drv->set_reg("S", p.readings[0], tol) != 0) {
+				probes[j].failed = true;
+				failed++;
+			}
+	}
+
+	return failed;
+}
+
+// Any command wakes a sleeping circuit, but it may not be taken; the
+// sleeping circuit may not even acknowledge it, so failures are expected
+void wake_send(probe &p) {
+	bus_write(p.drv->fd(), "I", 1);
+}
+
+void wake_start(probe &p, double now) {
+	p.asleep = false;
+	p.asleep_total += now - p.asleep_since;
+	p.waking = true;
+	p.wake_heard = false;
+	p.wake_sent = now;
+	wake_send(p);
+}
+
+// Polls a waking probe; returns true once it answers or is given up on
+bool wake_poll(probe &p, double now) {
+	char buf[64];
+	int size = std::min(p.type->bufsize, (int)sizeof(buf));
+
+	int code = (bus_read(p.drv->fd(), buf, size) >= 1) ? (unsigned char)buf[0] : -1;
+
+	// Awake once it is processing the command. Seen only when it is done,
+	// the processing time is not part of the wake-up.
+	if(!p.wake_heard && (code == 254 || code == 1)) {
+		double latency = std::max(0.0, now - p.wake_sent - (code == 1 ? DUTY_WAKE_CMD_S : 0));
+		wake_learn(p.wake, latency);
+		emit("%s wake %.3f %.3f\n", p.label.c_str(), latency, wake_lead(p.wake));
+		p.wake_heard = true;
+	}
+
+	if(code == 1) {
+		p.waking = false;
+		return true;
+	}
+
+	if(now - p.wake_sent > DUTY_WAKE_TIMEOUT_S) {
+		diag() << p.label << ": did not wake up." << std::endl;
+		p.waking = false;
+		return true;
+	}
+
+	// Still processing the command, or it is to be sent again
+	if(code != 254)
+		wake_send(p);
+
+	return false;
+}
+
+/*
+ * Wakes the sleeping probes due in cycle n, which starts at time start,
+ * each its own learned lead ahead. The waking probes are polled together,
+ * so one slow circuit does not delay the wake-up of the next.
+ */
+void wake_probes(std::vector<probe> &probes, long n, double start, cycle_state &cs) {
+	std::vector<std::pair<double, size_t> > &order = cs.wake_order;
+	order.clear();
+	for(size_t i=0; i<probes.size(); i++) {
+		probe &p = probes[i];
+		if(p.asleep && p.drv->fd() >= 0 && p.next_cycle <= n && health_available(p.health, start))
+			order.push_back(std::make_pair(start - wake_lead(p.wake), i));
+	}
+
+	std::sort(order.begin(), order.end());
+
+	size_t next = 0;
+	size_t waking = 0;
+
+	while((next < order.size() || waking > 0) && !stop_requested) {
+		double now = mono_now();
+
+		if(next < order.size() && now >= order[next].first) {
+			wake_start(probes[order[next++].second], now);
+			waking++;
+			continue;
+		}
+
+		for(size_t i=0; i<next; i++)
+			if(probes[order[i].second].waking && wake_poll(probes[order[i].second], now))
+				waking--;
+
+		double t = (next < order.size()) ? order[next].first : now;
+		if(waking > 0)
+			t = std::min(t, now + DUTY_POLL_US / 1e6);
+
+		rt_sleep_until(t);
+	}
+}
+
+// Writes out what is left in the outputs; returns status
+int stop_sinks(int status) {
+	if(metrics_srv)
+		metrics_srv->stop();
+
+	for(size_t i=0; i<sinks.size(); i++) {
+		sinks[i]->stop();
+
+		if(sinks[i]->dropped())
+			std::cerr << sinks[i]->dropped() << " lines dropped from " << sinks[i]->name() << "." << std::endl;
+	}
+
+	diag_stream() = &std::cerr;
+	bus_errors() = &std::cerr;
+
+	if(files) {
+		files->stop();
+		state_deferred() = NULL;
+		state_file_writer() = NULL;
+
+		if(files->dropped())
+			std::cerr << files->dropped() << " file writes dropped." << std::endl;
+	}
+
+	if(diag_sink)
+		diag_sink->stop();
+
+	return status;
+}
+
+/*
+ * Saves what the sampler has learned about each probe, a line per item:
+ *
+ *    probe <label> <restart reason> <every> <have ref> <ref>
+ *    filter <label> <parameter> <stage> <state of the stage>
+ *    wake <label> <samples> <smoothed> <deviation>
+ *    reading <label> <CLOCK_REALTIME> <values ...>
+ *    alarm <label> <rule> <parameter> <active>
+ *
+ * The compensation values need not be saved; they are in the shadow
+ * registers of the state directory already. The file writer writes it out.
+ */
+void save_snapshot(const std::vector<probe> &probes) {
+	std::string out;
+	char buf[256];
+
+	for(size_t i=0; i<probes.size(); i++) {
+		const probe &p = probes[i];
+		const char *label = p.label.c_str();
+
+		snprintf(buf, sizeof(buf), "probe %s %c %ld %d %.9g\n", label, p.reason ? p.reason : '?', p.every,
+		         p.have_ref, p.ref);
+		out += buf;
+
+		for(size_t j=0; j<p.filters.size(); j++)
+			for(size_t k=0; k<p.filters[j].size(); k++) {
+				snprintf(buf, sizeof(buf), "filter %s %lu %lu ", label, (unsigned long)j, (unsigned long)k);
+				out += buf + filter_state(p.filters[j][k]) + "\n";
+			}
+
+		snprintf(buf, sizeof(buf), "wake %s %d %.9g %.9g\n", label, p.wake.samples, p.wake.smoothed,
+		         p.wake.deviation);
+		out += buf;
+
+		if(!p.readings.empty()) {
+			const struct timespec &t = p.window.reply.real;
+			snprintf(buf, sizeof(buf), "reading %s %ld.%09ld", label, (long)t.tv_sec, t.tv_nsec);
+			out += buf;
+
+			for(size_t j=0; j<p.readings.size(); j++) {
+				snprintf(buf, sizeof(buf), " %.9g", p.readings[j]);
+				out += buf;
+			}
+
+			out += "\n";
+		}
+
+		for(size_t j=0; j<p.alarms.size(); j++) {
+			snprintf(buf, sizeof(buf), "alarm %s %s %lu %d\n", label, p.alarms[j].rule->name.c_str(),
+			         (unsigned long)p.alarms[j].param, p.alarms[j].active);
+			out += buf;
+		}
+	}
+
+	// Synced, or a power cut could leave an empty file in its place
+	files->push(snapshot_path, out, true);
+}
+
+// Takes the saved state of the probe from the lines of the snapshot;
+// returns true if there was any
+bool restore_probe(probe &p, const std::vector<std::string> &lines) {
+	bool found = false;
+
+	for(size_t i=0; i<lines.size(); i++) {
+		std::istringstream in(lines[i]);
+		std::string kind, label;
+
+		if(!(in >> kind >> label) || label != p.label)
+			continue;
+
+		found = true;
+
+		if(kind == "probe") {
+			char reason;
+			long every;
+			int have_ref;
+			float ref;
+
+			// Nothing is taken from a line that does not parse in full
+			if(in >> reason >> every >> have_ref >> ref) {
+				p.reason = (reason == '?') ? 0 : reason;
+				p.every = std::max(1L, std::min(every, p.max_every));
+				p.have_ref = have_ref;
+				p.ref = p.last = ref;
+			}
+		}
+
+		else if(kind == "filter") {
+			size_t param, stage;
+			std::string state;
+
+			if(in >> param >> stage && std::getline(in, state) && param < p.filters.size() &&
+			   stage < p.filters[param].size())
+				filter_restore(p.filters[param][stage], state);
+		}
+
+		else if(kind == "wake") {
+			wake_latency wake;
+			if(in >> wake.samples >> wake.smoothed >> wake.deviation)
+				p.wake = wake;
+		}
+
+		else if(kind == "reading") {
+			double t;
+			float value;
+
+			if(!(in >> t))
+				continue;
+
+			p.window.reply.real.tv_sec = (time_t)t;
+			p.window.reply.real.tv_nsec = (long)((t - (time_t)t) * 1e9);
+
+			p.readings.clear();
+			while(p.readings.size() < p.filters.size() && in >> value)
+				p.readings.push_back(value);
+
+			if(p.readings.size() != p.filters.size())
+				p.readings.clear();
+		}
+
+		else if(kind == "alarm") {
+			std::string rule;
+			size_t param;
+			int active;
+
+			if(in >> rule >> param >> active)
+				for(size_t j=0; j<p.alarms.size(); j++)
+					if(p.alarms[j].rule->name == rule && p.alarms[j].param == param)
+						p.alarms[j].active = active;
+		}
+	}
+
+	return found;
+}
+
+int main(int argc, char **argv) {
+	if(argc < 3) usage();
+	std::vector<std::string> args(argv, argv+argc);
+
+	std::string bus = args[1];
+	double interval = 0;
+	double max_interval = 0;
+	long count = -1;
+	bool print_plan = false;
+	bool feed_ec = true;
+	int rt_priority = 0;
+	int cpu = -1;
+	bool measure_jitter = false;
+	bool duty = false;
+	std::vector<alarm_rule> rules;
+	std::string metrics_at;
+	std::vector<std::string> out_files;
+	std::string mqtt_host;
+	int mqtt_port = 0;
+	std::string mqtt_prefix = "atsci";
+	int mqtt_qos = 0;
+	unsigned long out_lines = 4096;
+	output_policy policy = OUTPUT_DROP;
+	std::vector<probe> probes;
+
+	comp_config comp;
+	comp.have_temp = false;
+	comp.ec_probe = -1;
+	comp.temp_tol.value = 0.05;
+	comp.temp_tol.relative = false;
+	comp.sal_tol.value = 1;
+	comp.sal_tol.relative = true;
+
+	for(size_t i=2; i<args.size(); i++) {
+		if(args[i] == "-i") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%lf", &interval) != 1 || interval < 0)
+				usage();
+		}
+
+		else if(args[i] == "-n") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%ld", &count) != 1 || count < 1)
+				usage();
+		}
+
+		else if(args[i] == "-p")
+			print_plan = true;
+
+		else if(args[i] == "-f") {
+			std::vector<std::string> specs;
+			if(++i >= args.size())
+				usage();
+
+			if(fleet_load(args[i], specs) != 0) {
+				perror(args[i].c_str());
+				return 1;
+			}
+
+			for(size_t j=0; j<specs.size(); j++) {
+				probe p;
+				if(parse_probe(specs[j], p) != 0)
+					return 1;
+
+				p.bus = bus + p.bus;
+				p.drv = p.type->make_driver(p.bus, p.addr);
+				probes.push_back(p);
+			}
+		}
+
+		else if(args[i] == "-t") {
+			if(++i >= args.size() || parse_temp_source(args[i], comp.temp) != 0)
+				usage();
+
+			comp.have_temp = true;
+		}
+
+		else if(args[i] == "-E")
+			feed_ec = false;
+
+		else if(args[i] == "-a") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%lf", &max_interval) != 1 || max_interval <= 0)
+				usage();
+		}
+
+		else if(args[i] == "-R") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%d", &rt_priority) != 1 ||
+			   rt_priority < sched_get_priority_min(SCHED_FIFO) || rt_priority > sched_get_priority_max(SCHED_FIFO))
+				usage();
+		}
+
+		else if(args[i] == "-A") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%d", &cpu) != 1 || cpu < 0)
+				usage();
+		}
+
+		else if(args[i] == "-o") {
+			if(++i >= args.size()) usage();
+			out_files.push_back(args[i]);
+		}
+
+		else if(args[i] == "-M") {
+			if(++i >= args.size() || parse_mqtt_broker(args[i], mqtt_host, &mqtt_port) != 0)
+				usage();
+		}
+
+		else if(args[i] == "-P") {
+			if(++i >= args.size()) usage();
+			mqtt_prefix = args[i];
+		}
+
+		else if(args[i] == "-Q") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%d", &mqtt_qos) != 1 || mqtt_qos < 0 || mqtt_qos > 1)
+				usage();
+		}
+
+		else if(args[i] == "-B") {
+			if(++i >= args.size() || sscanf(args[i].c_str(), "%lu", &out_lines) != 1 || out_lines < 1)
+				usage();
+		}
+
+		else if(args[i] == "-O") {
+			if(++i >= args.size()) usage();
+
+			if(args[i] == "drop") policy = OUTPUT_DROP;
+			else if(args[i] == "block") policy = OUTPUT_BLOCK;
+			else usage();
+		}
+
+		else if(args[i] == "-T")
+			timestamps = true;
+
+		else if(args[i] == "-j")
+			measure_jitter = true;
+
+		else if(args[i] == "-S")
+			duty = true;
+
+		else if(args[i] == "-W") {
+			if(++i >= args.size()) usage();
+			snapshot_path = args[i];
+		}
+
+		else if(args[i] == "-H") {
+			if(++i >= args.size()) usage();
+			metrics_at = args[i];
+		}
+
+		else if(args[i] == "-L") {
+			if(++i >= args.size() || load_alarm_rules(args[i], rules) != 0)
+				usage();
+		}
+
+		else if(args[i] == "-c") {
+			if(++i >= args.size() || parse_comp_tol(args[i], comp) != 0)
+				usage();
+		}
+
+		else {
+			probe p;
+			if(parse_probe(args[i], p) != 0)
+				return 1;
+
+			p.bus = bus + p.bus;
+			p.drv = p.type->make_driver(p.bus, p.addr);
+			probes.push_back(p);
+		}
+	}
+
+	if(probes.empty() || (duty && interval == 0)) usage();
+
+	if(duty)
+		duty_interval = interval;
+
+	if(attach_alarms(probes, rules) != 0)
+		return 1;
+
+	// The hooks are not waited for
+	for(size_t i=0; i<rules.size(); i++)
+		if(!rules[i].exec.empty())
+			signal(SIGCHLD, SIG_IGN);
+
+	for(size_t i=0; feed_ec && i<probes.size(); i++)
+		if(probes[i].type->quiet_us && comp.ec_probe < 0)
+			comp.ec_probe = i;
+
+	std::vector<const probe_type *> types;
+	std::vector<bool> after;
+	for(size_t i=0; i<probes.size(); i++) {
+		probes[i].after_ec = (comp.ec_probe >= 0 && accepts_comp(probes[i], "S"));
+		types.push_back(probes[i].type);
+		after.push_back(probes[i].after_ec);
+	}
+
+	std::vector<sched_slot> plan;
+	long cycle_us = plan_cycle(types, after, plan);
+
+	if(print_plan) {
+		for(size_t i=0; i<plan.size(); i++)
+			printf("%s %ld %ld\n", probes[plan[i].probe].label.c_str(),
+			       plan[i].start_us / 1000, plan[i].end_us / 1000);
+
+		printf("cycle %ld\n", cycle_us / 1000);
+		return 0;
+	}
+
+	// Keep stdout for the readings, and the interference deadline in
+	// memory only since this process does all the measuring
+	diag_stream() = &std::cerr;
+	quiet_persist() = false;
+
+	sinks.push_back(new output_sink("stdout", STDOUT_FILENO, false, out_lines, policy));
+
+	for(size_t i=0; i<out_files.size(); i++) {
+		int fd = open(out_files[i].c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(fd < 0) {
+			perror("open");
+			std::cerr << "Unable to open " << out_files[i] << " for output." << std::endl;
+			return 1;
+		}
+
+		sinks.push_back(new output_sink(out_files[i], fd, true, out_lines, policy));
+	}
+
+	if(!mqtt_host.empty())
+		sinks.push_back(new mqtt_sink(mqtt_host, mqtt_port, mqtt_prefix, mqtt_qos, out_lines, policy));
+
+	for(size_t i=0; i<sinks.size(); i++)
+		if(sinks[i]->start() != 0)
+			return 1;
+
+	diag_sink = new output_sink("stderr", STDERR_FILENO, false, SAMPLER_DIAG_LINES, OUTPUT_DROP);
+	files = new file_writer(SAMPLER_FILE_JOBS);
+	if(diag_sink->start() != 0 || files->start() != 0)
+		return 1;
+
+	sink_streambuf diag_buf(*diag_sink);
+	std::ostream diag_out(&diag_buf);
+
+	if(max_interval > 0) {
+		if(interval == 0)
+			interval = cycle_us / 1e6;
+
+		for(size_t i=0; i<probes.size(); i++)
+			probes[i].max_every = std::max(1L, (long)(max_interval / interval));
+	}
+
+	metrics_store store;
+	metrics_server server(store);
+
+	if(!metrics_at.empty()) {
+		for(size_t i=0; i<probes.size(); i++) {
+			probes[i].metrics = store.add_probe(probes[i].label, probes[i].type->params, !probes[i].filter.empty());
+			probes[i].status_t = -METRICS_STATUS_S;
+		}
+
+		if(server.listen_on(metrics_at) != 0 || server.start() != 0)
+			return stop_sinks(1);
+
+		metrics = &store;
+		metrics_srv = &server;
+	}
+
+	std::vector<std::string> snapshot;
+	std::vector<char> saved_reason(probes.size(), 0);
+	std::vector<bool> restored(probes.size(), false);
+
+	if(!snapshot_path.empty()) {
+		FILE *f = fopen(snapshot_path.c_str(), "r");
+		char line[4096];
+
+		while(f && fgets(line, sizeof(line), f))
+			snapshot.push_back(line);
+
+		if(f) fclose(f);
+
+		for(size_t i=0; i<probes.size(); i++) {
+			probe &p = probes[i];
+			restored[i] = restore_probe(p, snapshot);
+			saved_reason[i] = p.reason;
+
+			if(metrics && !p.readings.empty())
+				for(size_t j=0; j<p.readings.size(); j++)
+					metrics->reading(p.metrics, j, p.readings[j], p.readings[j], p.window.reply.real);
+		}
+	}
+
+	// A probe missing at startup is quarantined like one that fails later,
+	// but with none at all the bus is probably wrong
+	size_t ready = 0;
+	for(size_t i=0; i<probes.size(); i++) {
+		if(init_probe(probes[i]) != 0) {
+			record_health(probes[i], false, mono_now());
+			continue;
+		}
+
+		ready++;
+
+		// Whether the circuit was still set up as it was left
+		if(restored[i])
+			emit("%s %s\n", probes[i].label.c_str(),
+			     (saved_reason[i] && probes[i].reason == saved_reason[i]) ? "resumed" : "restarted");
+	}
+
+	if(ready == 0) {
+		std::cerr << "None of the probes could be initialized." << std::endl;
+		return stop_sinks(1);
+	}
+
+	if(comp.have_temp && comp.temp.rtd_addr >= 0) {
+		comp.temp.rtd = new ezo_driver<rtd_traits>(bus, comp.temp.rtd_addr);
+		if(comp.temp.rtd->open() != 0 || comp.temp.rtd->check_format() != 0)
+			return stop_sinks(1);
+	}
+
+	if(cpu >= 0 && rt_pin_cpu(cpu) != 0)
+		return stop_sinks(1);
+
+	if(rt_priority > 0 && rt_setup(rt_priority) != 0)
+		return stop_sinks(1);
+
+	jitter_hist hist;
+	if(measure_jitter) {
+		jitter_init(hist);
+		jitter = &hist;
+	}
+
+	// From here on the state entries are kept in memory, and written out
+	// and reported on by the writer threads
+	state_preload(bus);
+	for(size_t i=0; i<probes.size(); i++)
+		state_preload(probes[i].bus);
+
+	state_file_writer() = files;
+	state_deferred() = state_write_later;
+	diag_stream() = &diag_out;
+	bus_errors() = &diag_out;
+
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+
+	cycle_state cycle;
+	double run_start = mono_now();
+	double saved = run_start;
+
+	for(long n=0; (count < 0 || n < count) && !stop_requested; n++) {
+		double start = mono_now();
+
+		for(size_t i=0; i<probes.size(); i++) {
+			probe &p = probes[i];
+			if(p.drv->fd() < 0 && p.next_cycle <= n && health_available(p.health, start) && init_probe(p) != 0)
+				record_health(p, false, mono_now());
+		}
+
+		plan_due(probes, comp, n, plan, cycle);
+		run_cycle(bus, probes, plan, comp, start, cycle);
+
+		for(size_t i=0; i<probes.size(); i++) {
+			if(!probes[i].due)
+				continue;
+
+			probes[i].next_cycle = n + probes[i].every;
+			record_health(probes[i], !probes[i].failed, mono_now());
+		}
+
+		if(!snapshot_path.empty() && mono_now() - saved >= SAMPLER_SNAPSHOT_S) {
+			save_snapshot(probes);
+			saved = mono_now();
+		}
+
+		if(duty && !stop_requested && (count < 0 || n + 1 < count))
+			wake_probes(probes, n + 1, start + interval, cycle);
+
+		if(interval > 0 && !stop_requested)
+			sleep_until(start + interval);
+	}
+
+	// The time each probe spent asleep, also when left asleep at exit
+	double run_time = mono_now() - run_start;
+	for(size_t i=0; duty && i<probes.size(); i++) {
+		probe &p = probes[i];
+		double asleep = p.asleep_total + (p.asleep ? run_start + run_time - p.asleep_since : 0);
+		emit("%s asleep %.1f %.1f\n", p.label.c_str(), asleep, run_time > 0 ? asleep / run_time * 100 : 0.0);
+	}
+
+	if(!snapshot_path.empty())
+		save_snapshot(probes);
+
+	if(jitter)
+		jitter_print(*jitter, emit);
+
+	if(transport().mux_switches)
+		emit("mux switches %ld\n", transport().mux_switches);
+
+	return stop_sinks(0);
+}
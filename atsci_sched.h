@@ -0,0 +1,200 @@
+#ifndef ATSCI_SCHED_H
+#define ATSCI_SCHED_H
+
+/*
+ * Measurement cycle scheduler for probes sharing the same water.
+ *
+ * The EC circuit excites the water during its conversion and disturbs the
+ * other probes until its quiet period after the conversion is over. Probes
+ * that cause no interference (pH, DO) are converted in parallel at the
+ * start of the cycle, and the interfering ones one after another once they
+ * are done, each waiting for the quiet period of the previous one.
+ *
+ * Probes that need an EC reading for their compensation (DO salinity) can
+ * instead be placed after the interfering ones, once the last quiet period
+ * is over. Otherwise the quiet period of the last interfering probe runs
+ * into the idle time between cycles and is left for the caller to enforce
+ * (see quiet_mark()).
+ *
+ * A STATUS query is a slot of its own too, right after the reading of its
+ * probe, so its processing time runs in parallel with the conversions of
+ * the others instead of holding up the cycle. It does not measure, so it
+ * neither causes nor suffers interference.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "atsci_ezo.h"
+#include "atsci_traits.h"
+
+// Run time description of a circuit type, made from its traits
+struct probe_type {
+	const char *name;            // Name on the command line, like "ph"
+	int addr;                    // Default I2C address
+	int bufsize;                 // Reply buffer size
+	long conv_us;                // Time from R to the reading being available
+	long quiet_us;               // Interference after the conversion, 0 if none
+	const char *const *params;   // Names of the values in the reading string
+	const ezo_reg *regs;         // Compensation and settings registers
+	ezo_device *(*make_driver)(const std::string &bus, int addr);
+};
+
+template<class T>
+ezo_device *make_driver(const std::string &bus, int addr) {
+	return new ezo_driver<T>(bus, addr);
+}
+
+template<class T>
+probe_type make_probe_type() {
+	probe_type type = { T::name(), T::addr, T::bufsize, T::conv_us, T::quiet_us,
+	                    T::params(), T::regs(), &make_driver<T> };
+	return type;
+}
+
+static const probe_type probe_types[] = {
+	make_probe_type<ph_traits>(),
+	make_probe_type<ec_traits>(),
+	make_probe_type<do_traits>(),
+	make_probe_type<rtd_traits>(),
+	{ NULL, 0, 0, 0, 0, NULL, NULL, NULL }
+};
+
+inline const probe_type *find_probe_type(const std::string &name) {
+	for(int i=0; probe_types[i].name; i++)
+		if(name == probe_types[i].name)
+			return &probe_types[i];
+
+	return NULL;
+}
+
+/*
+ * Where a probe given as "<type>[:<address>][@<mux>:<channel>][,...]" is,
+ * the syntax of the sampler and the fleet file. Without an address the
+ * probe is at the default one of its type.
+ */
+struct probe_place {
+	const probe_type *type;
+	int addr;
+	int mux;             // -1 if on the bus itself
+	int channel;
+	std::string route;   // "@<mux>:<channel>", or empty
+};
+
+inline int parse_probe_place(const std::string &spec, probe_place &p) {
+	std::string name = spec.substr(0, spec.find(','));
+	p.route = "";
+	p.addr = p.mux = p.channel = -1;
+
+	size_t at = name.find('@');
+	if(at != std::string::npos) {
+		std::string node;
+
+		p.route = name.substr(at);
+		name = name.substr(0, at);
+
+		if(parse_mux(p.route, node, &p.mux, &p.channel) != 0)
+			return 1;
+	}
+
+	size_t colon = name.find(':');
+	if(colon != std::string::npos) {
+		if(sscanf(name.c_str() + colon + 1, "%i", &p.addr) != 1 || p.addr < 0x01 || p.addr > 0x7F) {
+			std::cerr << "Invalid I2C address in probe: " << spec << std::endl;
+			return 1;
+		}
+
+		name = name.substr(0, colon);
+	}
+
+	p.type = find_probe_type(name);
+	if(!p.type) {
+		std::cerr << "Unknown probe type: " << name << std::endl;
+		return 1;
+	}
+
+	if(p.addr < 0)
+		p.addr = p.type->addr;
+
+	return 0;
+}
+
+// Processing time of a command that does not measure, like STATUS
+#define SCHED_COMMAND_US 350000
+
+enum slot_op { SLOT_READ, SLOT_STATUS };
+
+struct sched_slot {
+	size_t probe;   // Index into the list given to plan_cycle()
+	long start_us;  // Offset of the command (R or STATUS) from the start of the cycle
+	long end_us;    // Offset at which the reply can be fetched
+	slot_op op;
+
+	bool operator<(const sched_slot &o) const { return start_us < o.start_us; }
+};
+
+/*
+ * Plans one cycle for the given probes. Probes with after[i] set are
+ * converted only after all the interference is over, and those with
+ * status[i] set get a STATUS slot after their reading. Returns the slots
+ * sorted by start time, and the earliest start of the next cycle.
+ */
+inline long plan_cycle(const std::vector<const probe_type *> &types, const std::vector<bool> &after,
+                       std::vector<sched_slot> &plan, const std::vector<bool> *status = NULL) {
+	plan.clear();
+
+	long victims_end = 0;
+	for(size_t i=0; i<types.size(); i++) {
+		if(types[i]->quiet_us || after[i])
+			continue;
+
+		sched_slot slot = { i, 0, types[i]->conv_us, SLOT_READ };
+		plan.push_back(slot);
+
+		if(slot.end_us > victims_end)
+			victims_end = slot.end_us;
+	}
+
+	long t = victims_end;
+	for(size_t i=0; i<types.size(); i++) {
+		if(!types[i]->quiet_us)
+			continue;
+
+		sched_slot slot = { i, t, t + types[i]->conv_us, SLOT_READ };
+		plan.push_back(slot);
+		t = slot.end_us + types[i]->quiet_us;
+	}
+
+	long next = t;
+	for(size_t i=0; i<types.size(); i++) {
+		if(types[i]->quiet_us || !after[i])
+			continue;
+
+		sched_slot slot = { i, t, t + types[i]->conv_us, SLOT_READ };
+		plan.push_back(slot);
+
+		if(slot.end_us > next)
+			next = slot.end_us;
+	}
+
+	for(size_t i=0, n=plan.size(); status && i<n; i++) {
+		if(!(*status)[plan[i].probe])
+			continue;
+
+		sched_slot slot = { plan[i].probe, plan[i].end_us, plan[i].end_us + SCHED_COMMAND_US, SLOT_STATUS };
+		plan.push_back(slot);
+
+		if(slot.end_us > next)
+			next = slot.end_us;
+	}
+
+	std::stable_sort(plan.begin(), plan.end());
+	return next;
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef ATSCI_SHADOW_H
+#define ATSCI_SHADOW_H
+
+/*
+ * Shadow registers: the last values written to (or read back from) the
+ * compensation and settings registers of a circuit, like T, K, S, P and
+ * L. A set operation whose value matches the shadow within a tolerance
+ * skips the 350 ms bus transaction altogether.
+ *
+ * A circuit forgets its settings when it restarts, so the shadow also
+ * records the restart reason from STATUS. Once the shadow is older than
+ * SHADOW_VERIFY_S seconds, STATUS is queried again before it is trusted,
+ * and a different restart reason or a failing query throws it away. The
+ * reason alone does not tell one power cycle from two, so the registers in
+ * the shadow are then also read back, and any that no longer holds its
+ * value throws the shadow away too. Callers should also call
+ * shadow_invalidate() after failed transactions, since a circuit that lost
+ * power typically stops answering first.
+ */
+
+#include <map>
+#include <sstream>
+#include <string>
+
+#include <math.h>
+#include <stdio.h>
+
+#include "atsci_i2c.h"
+#include "atsci_state.h"
+
+#define SHADOW_VERIFY_S 60
+
+// A register read back still holds the value written if it is this close;
+// the circuit reports some registers with fewer decimals than were sent
+#define SHADOW_READBACK_TOL 0.051
+
+struct shadow_regs {
+	char reason;      // Restart reason when last verified, 0 if unknown
+	double verified;  // When STATUS was last checked
+	std::map<std::string, float> values;
+};
+
+inline void shadow_load(const std::string &bus, int addr, shadow_regs &sh) {
+	sh.reason = 0;
+	sh.verified = 0;
+	sh.values.clear();
+
+	std::string entry;
+	if(state_read(bus, addr, "shadow", entry) != 0)
+		return;
+
+	std::istringstream in(entry);
+	std::string item;
+
+	if(!(in >> sh.reason >> sh.verified) || sh.reason == '?') {
+		sh.reason = 0;
+		return;
+	}
+
+	while(in >> item) {
+		size_t eq = item.find('=');
+		float value;
+
+		if(eq != std::string::npos && sscanf(item.c_str() + eq + 1, "%f", &value) == 1)
+			sh.values[item.substr(0, eq)] = value;
+	}
+}
+
+inline void shadow_save(const std::string &bus, int addr, const shadow_regs &sh) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%c %.3f", sh.reason ? sh.reason : '?', sh.verified);
+
+	std::string entry = buf;
+	for(std::map<std::string, float>::const_iterator it = sh.values.begin(); it != sh.values.end(); ++it) {
+		snprintf(buf, sizeof(buf), " %s=%.9g", it->first.c_str(), it->second);
+		entry += buf;
+	}
+
+	state_write(bus, addr, "shadow", entry);
+}
+
+inline void shadow_invalidate(const std::string &bus, int addr) {
+	shadow_regs sh;
+	sh.reason = 0;
+	sh.verified = 0;
+	shadow_save(bus, addr, sh);
+}
+
+// Queries the restart reason with STATUS; returns 0 on success
+inline int query_restart_reason(int dev, char *reason, int size = EZO_BUFSIZE) {
+	if(write_string("STATUS", dev) != 0)
+		return 1;
+
+	usleep(350000); // Sleep min 300 milliseconds
+
+	std::string result;
+	if(read_string(result, dev, size) != 0)
+		return 1;
+
+	if(result.length() < 9)
+		return 1;
+
+	*reason = result[8];
+	return 0;
+}
+
+// Reads a register back with "<reg>,?"; returns 0 on success
+inline int query_reg(int dev, const std::string &reg, float *value, int size = EZO_BUFSIZE) {
+	if(write_string(reg + ",?", dev) != 0)
+		return 1;
+
+	usleep(350000); // Sleep min 300 milliseconds
+
+	std::string result;
+	if(read_string(result, dev, size) != 0)
+		return 1;
+
+	// The reply is like "?T,25.0"
+	if(result.length() < reg.size() + 2 || sscanf(result.c_str() + reg.size() + 2, "%f", value) != 1)
+		return 1;
+
+	return 0;
+}
+
+// Whether the circuit still has what the shadow says: the same restart
+// reason, and every register in the shadow holding its value
+inline bool shadow_verify(int dev, const shadow_regs &sh, int size = EZO_BUFSIZE) {
+	char reason;
+	if(query_restart_reason(dev, &reason, size) != 0 || reason != sh.reason)
+		return false;
+
+	for(std::map<std::string, float>::const_iterator it = sh.values.begin(); it != sh.values.end(); ++it) {
+		float value;
+		if(query_reg(dev, it->first, &value, size) != 0 ||
+		   fabs(value - it->second) > SHADOW_READBACK_TOL + fabs(it->second) * 1e-4)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns true if reg is known to hold value within tol, in which case the
+ * write can be skipped. Otherwise forgets reg, so that the shadow is never
+ * left claiming a value a failed write may not have set.
+ */
+inline bool shadow_skip(int dev, const std::string &bus, int addr, const std::string &reg,
+                        float value, float tol, int size = EZO_BUFSIZE) {
+	shadow_regs sh;
+	shadow_load(bus, addr, sh);
+
+	std::map<std::string, float>::iterator it = sh.values.find(reg);
+	bool match = (tol >= 0 && it != sh.values.end() && fabs(it->second - value) <= tol + 1e-6);
+
+	if(match && state_now() - sh.verified > SHADOW_VERIFY_S) {
+		if(!shadow_verify(dev, sh, size)) {
+			shadow_invalidate(bus, addr);
+			return false;
+		}
+
+		sh.verified = state_now();
+		shadow_save(bus, addr, sh);
+	}
+
+	if(match)
+		return true;
+
+	if(it != sh.values.end()) {
+		sh.values.erase(it);
+		shadow_save(bus, addr, sh);
+	}
+
+	return false;
+}
+
+// Records a value that was just written to or read from the device
+inline void shadow_store(int dev, const std::string &bus, int addr, const std::string &reg,
+                         float value, int size = EZO_BUFSIZE) {
+	shadow_regs sh;
+	shadow_load(bus, addr, sh);
+
+	// Start a new shadow from the current restart reason
+	if(!sh.reason) {
+		if(query_restart_reason(dev, &sh.reason, size) != 0)
+			return;
+
+		sh.verified = state_now();
+		sh.values.clear();
+	}
+
+	sh.values[reg] = value;
+	shadow_save(bus, addr, sh);
+}
+
+// Records a value just written in the shadow, if there is one. Unlike
+// shadow_store() it never starts a new shadow, which takes a STATUS query.
+inline void shadow_note(const std::string &bus, int addr, const std::string &reg, float value) {
+	shadow_regs sh;
+	shadow_load(bus, addr, sh);
+
+	if(!sh.reason)
+		return;
+
+	sh.values[reg] = value;
+	shadow_save(bus, addr, sh);
+}
+
+// Parses "--tolerance <d>" from args[pos]; returns 0 on success.
+inline int parse_tolerance(const std::vector<std::string> &args, size_t pos, float *tol) {
+	if(args.size() != pos + 2 || args[pos] != "--tolerance")
+		return 1;
+
+	if(sscanf(args[pos+1].c_str(), "%f", tol) != 1)
+		return 1;
+
+	return 0;
+}
+
+#endif
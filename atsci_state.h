@@ -0,0 +1,387 @@
+#ifndef ATSCI_STATE_H
+#define ATSCI_STATE_H
+
+/*
+ * Small persistent state store shared by the atsci_* tools. Every entry is
+ * a one-line text file under the state directory, keyed by I2C bus, device
+ * address and entry name, so separate invocations of the tools can share
+ * recent readings and other knowledge about the circuits.
+ *
+ * The directory is $ATSCI_STATE_DIR if set, or else atsci under
+ * $XDG_RUNTIME_DIR, or /run/atsci. The tools usually run as root to open
+ * the device node, so the directory must not be one another user could
+ * have prepared: it is created private, and an existing one is used only
+ * if it is a real directory owned by the user and writable by no one else.
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+inline std::string state_dir() {
+	const char *dir = getenv("ATSCI_STATE_DIR");
+	if(dir && *dir)
+		return dir;
+
+	const char *run = getenv("XDG_RUNTIME_DIR");
+	return (run && *run) ? std::string(run) + "/atsci" : "/run/atsci";
+}
+
+// Creates the state directory if needed; false if it cannot be trusted
+inline bool state_dir_ok() {
+	static std::string checked, refused;
+	std::string dir = state_dir();
+
+	if(dir == checked)
+		return true;
+
+	if(dir == refused)
+		return false;
+
+	if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+		return false;
+
+	struct stat st;
+	if(lstat(dir.c_str(), &st) != 0)
+		return false;
+
+	if(!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		static bool warned = false;
+		if(!warned)
+			std::cerr << "Not using the state directory " << dir << ": it is not a directory of this user"
+			          << " that only the user can write to." << std::endl;
+
+		warned = true;
+		refused = dir;
+		return false;
+	}
+
+	checked = dir;
+	return true;
+}
+
+inline double state_now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// The bus as the start of a file name
+inline std::string state_key(const std::string &bus) {
+	std::string key;
+
+	for(size_t i=0; i<bus.size(); i++)
+		key += (bus[i] == '/') ? '_' : bus[i];
+
+	return key;
+}
+
+inline std::string state_path(const std::string &bus, int addr, const std::string &name) {
+	char saddr[8];
+	snprintf(saddr, sizeof(saddr), "%02x", addr);
+
+	return state_dir() + "/" + state_key(bus) + "-" + saddr + "-" + name;
+}
+
+/*
+ * Deferred writes, for callers that must not wait for the disk, like the
+ * measuring thread of the sampler. Once state_deferred() is set, each entry
+ * written is kept in memory and its file write handed to that function,
+ * which is to queue it for another thread. Entries are then read from
+ * memory only, so the ones needed must be loaded with state_preload()
+ * first.
+ */
+typedef void (*state_writer)(const std::string &path, const std::string &data);
+
+inline state_writer &state_deferred() {
+	static state_writer writer = NULL;
+	return writer;
+}
+
+// The entries in memory, by path
+inline std::map<std::string, std::string> &state_memory() {
+	static std::map<std::string, std::string> entries;
+	return entries;
+}
+
+inline int state_file_read(const std::string &path, std::string &out) {
+	FILE *f = fopen(path.c_str(), "r");
+	if(!f) return 1;
+
+	char buf[256];
+	if(!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+
+	out = buf;
+	if(!out.empty() && out[out.size()-1] == '\n')
+		out.erase(out.size()-1);
+
+	return 0;
+}
+
+inline int state_read(const std::string &bus, int addr, const std::string &name, std::string &out) {
+	if(state_deferred()) {
+		std::map<std::string, std::string>::const_iterator it = state_memory().find(state_path(bus, addr, name));
+		if(it == state_memory().end())
+			return 1;
+
+		out = it->second;
+		return 0;
+	}
+
+	if(!state_dir_ok())
+		return 1;
+
+	return state_file_read(state_path(bus, addr, name), out);
+}
+
+// Loads the entries of the bus into memory, for deferred writes, once per
+// bus; an entry already in memory is newer than its file
+inline void state_preload(const std::string &bus) {
+	static std::map<std::string, bool> loaded;
+	if(loaded[bus] || !state_dir_ok())
+		return;
+
+	loaded[bus] = true;
+
+	std::string dir = state_dir();
+	std::string prefix = state_key(bus) + "-";
+
+	DIR *d = opendir(dir.c_str());
+	if(!d) return;
+
+	struct dirent *e;
+	while((e = readdir(d))) {
+		std::string name = e->d_name;
+
+		// Entry names have no dots; the temporary files of writes do
+		if(name.compare(0, prefix.size(), prefix) != 0 || name.find('.', prefix.size()) != std::string::npos)
+			continue;
+
+		std::string entry;
+		if(state_file_read(dir + "/" + name, entry) == 0)
+			state_memory().insert(std::make_pair(dir + "/" + name, entry));
+	}
+
+	closedir(d);
+}
+
+/*
+ * Replaces the file at path with data through a temporary file and
+ * rename(), so a concurrent reader never sees a half-written file. The
+ * temporary file is created exclusively under an unpredictable name, so
+ * nothing planted in the directory is followed or overwritten. With sync,
+ * the data and then the rename are flushed to the disk before returning,
+ * so a power cut leaves either the old file or the new one.
+ */
+inline int state_file_write(const std::string &path, const std::string &data, bool sync = false) {
+	std::string tmp = path + ".XXXXXX";
+	std::vector<char> name(tmp.begin(), tmp.end());
+	name.push_back('\0');
+
+	int fd = mkstemp(&name[0]);
+	if(fd < 0)
+		return 1;
+
+	size_t done = 0;
+	while(done < data.size()) {
+		ssize_t n = write(fd, data.data() + done, data.size() - done);
+		if(n < 0 && errno == EINTR)
+			continue;
+
+		if(n <= 0)
+			break;
+
+		done += n;
+	}
+
+	bool ok = (done == data.size()) && !(sync && fsync(fd) != 0);
+
+	if(close(fd) != 0 || !ok || rename(&name[0], path.c_str()) != 0) {
+		unlink(&name[0]);
+		return 1;
+	}
+
+	if(sync) {
+		size_t slash = path.rfind('/');
+		std::string dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+
+		int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if(dfd < 0)
+			return 1;
+
+		ok = (fsync(dfd) == 0);
+		close(dfd);
+		return !ok;
+	}
+
+	return 0;
+}
+
+inline int state_write(const std::string &bus, int addr, const std::string &name, const std::string &data) {
+	if(!state_dir_ok())
+		return 1;
+
+	std::string path = state_path(bus, addr, name);
+
+	if(state_deferred()) {
+		state_memory()[path] = data;
+		state_deferred()(path, data + "\n");
+		return 0;
+	}
+
+	return state_file_write(path, data + "\n");
+}
+
+/*
+ * Compensation signature: the compensation values last set through the
+ * tools, like "T=25,K=1". A cached reading is only reused while the
+ * signature it was measured with is still current.
+ */
+inline std::string comp_signature(const std::string &bus, int addr, const char *const *names) {
+	std::string sig;
+
+	for(int i=0; names[i]; i++) {
+		std::string value;
+		if(state_read(bus, addr, std::string("comp-") + names[i], value) != 0)
+			value = "?";
+
+		if(i) sig += ",";
+		sig += std::string(names[i]) + "=" + value;
+	}
+
+	return sig;
+}
+
+inline void comp_store(const std::string &bus, int addr, const std::string &name, float value) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%g", value);
+	state_write(bus, addr, "comp-" + name, buf);
+}
+
+/*
+ * Result cache. One entry per measurement type, holding the value, the
+ * time it was measured and the compensation signature in effect.
+ */
+inline void cache_store(const std::string &bus, int addr, const std::string &type,
+                        const std::string &comp, float value) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%.9g %.3f ", value, state_now());
+	state_write(bus, addr, "cache-" + type, buf + comp);
+}
+
+// Returns 0 and sets value if a reading no older than max_age seconds
+// exists for the given compensation signature.
+inline int cache_lookup(const std::string &bus, int addr, const std::string &type,
+                        const std::string &comp, double max_age, float *value) {
+	std::string entry;
+	if(state_read(bus, addr, "cache-" + type, entry) != 0)
+		return 1;
+
+	float cached;
+	double stamp;
+	char sig[200];
+	if(sscanf(entry.c_str(), "%f %lf %199s", &cached, &stamp, sig) != 3)
+		return 1;
+
+	double age = state_now() - stamp;
+	if(age < 0 || age > max_age || comp != sig)
+		return 1;
+
+	*value = cached;
+	return 0;
+}
+
+/*
+ * Interference quiet period. A conductivity measurement disturbs the other
+ * probes in the same water for a while after it has completed. Instead of
+ * sleeping that out, the measuring tool records when the disturbance is
+ * over, and the next measurement on the same bus waits until then.
+ *
+ * The probes share the water whichever mux channel they are behind, so the
+ * deadline belongs to the bus node itself: "<node>@<mux>:<channel>" counts
+ * as <node>. It is always kept in memory, and for the one-shot tools also
+ * persisted per node (under address 0, the general call address) so that
+ * the next invocation sees it. Long-running callers can turn off the
+ * persistence with quiet_persist() = false.
+ */
+// The bus node without the mux channel
+inline std::string quiet_bus(const std::string &bus) {
+	return bus.substr(0, bus.rfind('@'));
+}
+
+// The deadline in memory, per bus node
+inline double &quiet_until(const std::string &bus) {
+	static std::map<std::string, double> until;
+	return until[quiet_bus(bus)];
+}
+
+inline bool &quiet_persist() {
+	static bool persist = true;
+	return persist;
+}
+
+// The deadline persisted for the bus; 0 if none
+inline double quiet_stored(const std::string &bus) {
+	std::string entry;
+	double stored;
+	if(!quiet_persist() || state_read(quiet_bus(bus), 0, "quiet", entry) != 0 || sscanf(entry.c_str(), "%lf", &stored) != 1)
+		return 0;
+
+	return stored;
+}
+
+inline double quiet_deadline(const std::string &bus) {
+	double stored = quiet_stored(bus);
+	return (stored > quiet_until(bus)) ? stored : quiet_until(bus);
+}
+
+inline void quiet_mark(const std::string &bus, double seconds) {
+	double until = state_now() + seconds;
+	if(until > quiet_until(bus))
+		quiet_until(bus) = until;
+
+	// Against the stored deadline only: the one in memory is already until
+	if(quiet_persist() && until > quiet_stored(bus)) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.3f", until);
+		state_write(quiet_bus(bus), 0, "quiet", buf);
+	}
+}
+
+// Call before starting a measurement on the bus
+inline void quiet_wait(const std::string &bus) {
+	double left = quiet_deadline(bus) - state_now();
+
+	// Anything longer than a few seconds must be a clock step; ignore it
+	if(left > 0 && left < 10)
+		usleep((useconds_t)(left * 1e6));
+}
+
+// Parses "--max-age <seconds>" from args[pos]; returns 0 on success.
+inline int parse_max_age(const std::vector<std::string> &args, size_t pos, double *max_age) {
+	if(args.size() != pos + 2 || args[pos] != "--max-age")
+		return 1;
+
+	if(sscanf(args[pos+1].c_str(), "%lf", max_age) != 1 || *max_age < 0)
+		return 1;
+
+	return 0;
+}
+
+#endif
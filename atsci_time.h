@@ -0,0 +1,75 @@
+#ifndef ATSCI_TIME_H
+#define ATSCI_TIME_H
+
+/*
+ * Timestamps of a measurement window: when the R command went out and when
+ * the reply came back, on both CLOCK_MONOTONIC (for intervals and aligning
+ * probes) and CLOCK_REALTIME (for the wall clock).
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+struct clock_pair {
+	struct timespec mono;
+	struct timespec real;
+};
+
+struct sample_window {
+	clock_pair start;   // R command written
+	clock_pair reply;   // Reading read back
+};
+
+inline void clock_pair_now(clock_pair &t) {
+	clock_gettime(CLOCK_MONOTONIC, &t.mono);
+	clock_gettime(CLOCK_REALTIME, &t.real);
+}
+
+inline struct timespec timespec_mid(const struct timespec &a, const struct timespec &b) {
+	// Halve the difference separately so nothing overflows a 32-bit long
+	long sec = b.tv_sec - a.tv_sec;
+	long nsec = b.tv_nsec - a.tv_nsec + (sec % 2) * 1000000000L;
+
+	struct timespec mid;
+	mid.tv_sec = a.tv_sec + sec / 2;
+	mid.tv_nsec = a.tv_nsec + nsec / 2;
+
+	while(mid.tv_nsec >= 1000000000L) { mid.tv_sec++; mid.tv_nsec -= 1000000000L; }
+	while(mid.tv_nsec < 0) { mid.tv_sec--; mid.tv_nsec += 1000000000L; }
+
+	return mid;
+}
+
+inline clock_pair window_mid(const sample_window &w) {
+	clock_pair mid;
+	mid.mono = timespec_mid(w.start.mono, w.reply.mono);
+	mid.real = timespec_mid(w.start.real, w.reply.real);
+	return mid;
+}
+
+/*
+ * Formats "[<label> ]time <R mono> <R real> <reply mono> <reply real>
+ * <mid mono> <mid real>\n", each in seconds with nanoseconds.
+ */
+inline const char *format_window(char *buf, size_t size, const char *label, const sample_window &w) {
+	clock_pair mid = window_mid(w);
+	const struct timespec *ts[] = { &w.start.mono, &w.start.real, &w.reply.mono, &w.reply.real,
+	                                &mid.mono, &mid.real };
+
+	int len = snprintf(buf, size, "%s%stime", label, *label ? " " : "");
+
+	for(size_t i=0; i<sizeof(ts)/sizeof(ts[0]) && len >= 0 && (size_t)len < size; i++)
+		len += snprintf(buf + len, size - len, " %ld.%09ld", (long)ts[i]->tv_sec, ts[i]->tv_nsec);
+
+	if(len >= 0 && (size_t)len < size)
+		snprintf(buf + len, size - len, "\n");
+
+	return buf;
+}
+
+inline void print_window(const char *label, const sample_window &w) {
+	char buf[160];
+	printf("%s", format_window(buf, sizeof(buf), label, w));
+}
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef ATSCI_TRAITS_H
+#define ATSCI_TRAITS_H
+
+/*
+ * Per-circuit traits for ezo_driver<> and ezo_main<>. Everything that
+ * differs between the EZO circuit types lives here: the default address,
+ * reply buffer size, conversion and calibration delays, output parameters,
+ * compensation registers, calibration sub-commands and the operations the
+ * command line tool offers. The numbers are compile time constants, so the
+ * driver templates resolve them without any runtime dispatch.
+ *
+ * A new circuit type needs a traits struct like these and a two-line
+ * atsci_<type>.cpp calling ezo_main<>.
+ */
+
+#include <stdio.h>
+
+#include "atsci_i2c.h"
+
+// A compensation or settings register
+struct ezo_reg {
+	const char *op;     // Operation name on the command line
+	const char *cmd;    // Command letter, like "T"
+};
+
+// A read operation returning one of the parameters of the reading
+struct ezo_read_op {
+	const char *op;
+	int param;          // Index into params()
+	int avg;            // Takes a count and returns the average
+};
+
+// A calibration sub-command
+struct ezo_cal_op {
+	const char *op;     // Sub-command name, empty if the value comes first
+	const char *cmd;    // Command sent to the circuit
+	const char *fmt;    // Format of the value appended to cmd, NULL if none
+	long delay_us;
+};
+
+struct ph_traits {
+	enum {
+		addr = 0x63,
+		bufsize = 32,
+		conv_us = 1050000,        // Sleep min 1 second
+		quiet_us = 0,
+		cal_clear_us = 350000,    // Sleep min 300 milliseconds
+		has_read_all = 0
+	};
+
+	static const char *name() { return "ph"; }
+	static const char *title() { return "pH"; }
+	static const char *print_format() { return "%.2f\n"; }
+
+	static const char *const *params() {
+		static const char *const p[] = { "pH", NULL };
+		return p;
+	}
+
+	// Output parameters the device may print, in order; NULL if fixed
+	static const char *const *output_order() { return NULL; }
+
+	static const ezo_reg *regs() {
+		static const ezo_reg r[] = {
+			{ "temp", "T" },
+			{ NULL, NULL }
+		};
+		return r;
+	}
+
+	static const ezo_read_op *read_ops() {
+		static const ezo_read_op r[] = {
+			{ "read", 0, 0 },
+			{ "read_avg", 0, 1 },
+			{ NULL, 0, 0 }
+		};
+		return r;
+	}
+
+	static const ezo_cal_op *cal_ops() {
+		static const ezo_cal_op c[] = {
+			{ "mid", "Cal,mid", "%.2f", 1350000 },   // Sleep min 1.3 seconds
+			{ "low", "Cal,low", "%.2f", 1350000 },
+			{ "high", "Cal,high", "%.2f", 1350000 },
+			{ NULL, NULL, NULL, 0 }
+		};
+		return c;
+	}
+
+	// Standard deviation of the readings under which the probe is settled
+	// in a calibration solution
+	static double cal_stddev(double) { return 0.005; }
+
+	static int check_format(int) { return 0; }
+
+	static const char *usage() {
+		return	"   read               Get a reading from the probe\n"
+			"   read --max-age <s> Reuse a reading at most s seconds old, if any\n"
+			"   read_avg <count>   Read count times and return average.\n"
+			"   info               Get device type and firmware version\n"
+			"   status             Get reason for previous restart, and voltage at VCC pin\n"
+			"   temp get           Query current temperature compensation value\n"
+			"   temp set <T>       Set temperature compensation value (Celsius)\n"
+			"   temp set rtd[:addr]\n"
+			"                      Set it from an EZO RTD circuit on the same bus\n"
+			"   led get            Query LED status\n"
+			"   led set <on/off>   Turn LED on/off\n"
+			"   cal get            Get calibration status\n"
+			"   cal clear          Clear all calibration data\n"
+			"   cal mid <pH>       Midpoint calibration at given pH, preferably 7.00. Clears low\n"
+			"                      and high calibration points, so this must be done first!\n"
+			"   cal low <pH>       Lowpoint calibration at given pH, should be from 1.00 to 6.00\n"
+			"   cal high <pH>      Highpoint calibration at given pH, should be from 8.00 to 14.00\n"
+			"   sleep              Enter low-power sleep mode.\n";
+	}
+};
+
+struct ec_traits {
+	enum {
+		addr = 0x64,
+		bufsize = 64,
+		conv_us = 1050000,        // Sleep min 1 second
+		quiet_us = 1500000,       // Electrical interference after a reading
+		cal_clear_us = 500000,    // Sleep min 300 milliseconds
+		has_read_all = 1
+	};
+
+	static const char *name() { return "ec"; }
+	static const char *title() { return "EC"; }
+	static const char *print_format() { return "%g\n"; }
+
+	static const char *const *params() {
+		static const char *const p[] = { "EC", NULL };
+		return p;
+	}
+
+	static const char *const *output_order() {
+		static const char *const o[] = { "EC", "TDS", "S", "SG", NULL };
+		return o;
+	}
+
+	static const ezo_reg *regs() {
+		static const ezo_reg r[] = {
+			{ "temp", "T" },
+			{ "K", "K" },
+			{ NULL, NULL }
+		};
+		return r;
+	}
+
+	static const ezo_read_op *read_ops() {
+		static const ezo_read_op r[] = {
+			{ "read", 0, 0 },
+			{ "read_avg", 0, 1 },
+			{ NULL, 0, 0 }
+		};
+		return r;
+	}
+
+	static const ezo_cal_op *cal_ops() {
+		static const ezo_cal_op c[] = {
+			{ "dry", "Cal,dry", NULL, 2000000 },     // Sleep min 1.3 seconds
+			{ "one", "Cal,one", "%.3f", 2000000 },
+			{ "low", "Cal,low", "%.3f", 2000000 },
+			{ "high", "Cal,high", "%.3f", 2000000 },
+			{ NULL, NULL, NULL, 0 }
+		};
+		return c;
+	}
+
+	// Relative to the reading, since the solutions range over decades
+	static double cal_stddev(double mean) { return mean > 1000 ? mean * 0.001 : 1.0; }
+
+	static int check_format(int dev) {
+		return ensure_output(dev, "EC", bufsize);
+	}
+
+	static const char *usage() {
+		return	"   read               Get a reading from the probe\n"
+			"   read --max-age <s> Reuse a reading at most s seconds old, if any\n"
+			"   read_avg <count>   Read count times and return average.\n"
+			"   read_all           Get all enabled parameters (EC, TDS, S, SG) from\n"
+			"                      a single reading, one \"<name> <value>\" per line\n"
+			"   read_avg_all <count>\n"
+			"                      Read count times and return the average of each.\n"
+			"   info               Get device type and firmware version\n"
+			"   status             Get reason for previous restart, and voltage at VCC pin\n"
+			"   temp get           Query current temperature compensation value\n"
+			"   temp set <T>       Set temperature compensation value (Celsius)\n"
+			"   temp set rtd[:addr]\n"
+			"                      Set it from an EZO RTD circuit on the same bus\n"
+			"   K get              Query probe K constant\n"
+			"   K set <K>          Set probe K constant\n"
+			"   led get            Query LED status\n"
+			"   led set <on/off>   Turn LED on/off\n"
+			"   cal get            Get calibration status\n"
+			"   cal clear          Clear all calibration data\n"
+			"   cal dry            Start calibration. Probe must be dry first.\n"
+			"   cal one <EC>       Single point calibration at EC (after 'cal dry'). Ends calibration.\n"
+			"   cal low <EC>       Start dual point calibration (after 'cal dry'). Low point at EC.\n"
+			"   cal high <EC>      Continue dual point calibration (after 'cal dry'). High point at EC.\n"
+			"   sleep              Enter low-power sleep mode.\n";
+	}
+};
+
+struct do_traits {
+	enum {
+		addr = 0x61,
+		bufsize = 64,
+		conv_us = 1050000,        // Sleep min 1 second
+		quiet_us = 0,
+		cal_clear_us = 500000,    // Sleep min 300 milliseconds
+		has_read_all = 1
+	};
+
+	static const char *name() { return "do"; }
+	static const char *title() { return "dissolved oxygen"; }
+	static const char *print_format() { return "%g\n"; }
+
+	static const char *const *params() {
+		static const char *const p[] = { "DO", "%", NULL };
+		return p;
+	}
+
+	static const char *const *output_order() { return NULL; }
+
+	static const ezo_reg *regs() {
+		static const ezo_reg r[] = {
+			{ "temp", "T" },
+			{ "EC", "S" },
+			{ "pressure", "P" },
+			{ NULL, NULL }
+		};
+		return r;
+	}
+
+	static const ezo_read_op *read_ops() {
+		static const ezo_read_op r[] = {
+			{ "read_do", 0, 0 },
+			{ "read_saturation", 1, 0 },
+			{ "read_avgdo", 0, 1 },
+			{ "read_avgsat", 1, 1 },
+			{ NULL, 0, 0 }
+		};
+		return r;
+	}
+
+	static const ezo_cal_op *cal_ops() {
+		static const ezo_cal_op c[] = {
+			{ "zero", "Cal,0", NULL, 2000000 },      // Sleep min 1.3 seconds
+			{ "atmospheric", "Cal", NULL, 2000000 },
+			{ NULL, NULL, NULL, 0 }
+		};
+		return c;
+	}
+
+	static double cal_stddev(double) { return 0.02; }
+
+	static int check_format(int dev) {
+		if(ensure_output(dev, "%", bufsize) != 0)
+			return 1;
+
+		return ensure_output(dev, "DO", bufsize);
+	}
+
+	static const char *usage() {
+		return	"   read_saturation     Get saturation reading from the probe\n"
+			"   read_do             Get dissolved oxygen reading in mg/L\n"
+			"   read_saturation --max-age <s>\n"
+			"   read_do --max-age <s>\n"
+			"                       Reuse a reading at most s seconds old, if any\n"
+			"   read_avgsat <count> Read count times and return average\n"
+			"   read_avgdo <count>  Read count times and return average\n"
+			"   read_all            Get both DO and saturation from a single reading,\n"
+			"                       as \"DO <mg/L>\" and \"% <saturation>\" lines\n"
+			"   read_avg_all <count>\n"
+			"                       Read count times and return the average of each\n"
+			"   info                Get device type and firmware version\n"
+			"   status              Get reason for previous restart, and voltage at VCC pin\n"
+			"   temp get            Query current temperature compensation value\n"
+			"   temp set <T>        Set temperature compensation value (Celsius)\n"
+			"   temp set rtd[:addr] Set it from an EZO RTD circuit on the same bus\n"
+			"   EC get              Query current conductivity compensation value (uS/cm)\n"
+			"   EC set <EC>         Set conductivity compensation value (uS/cm)\n"
+			"   pressure get        Query current pressure compensation value (kPa)\n"
+			"   pressure set <P>    Set pressure compensation value (kPa)\n"
+			"   led get             Query LED status\n"
+			"   led set <on/off>    Turn LED on/off\n"
+			"   cal get             Get calibration status\n"
+			"   cal clear           Clear all calibration data\n"
+			"   cal zero            Calibrate at zero dissolved oxygen level\n"
+			"   cal atmospheric     Calibrate at atmospheric oxygen levels\n"
+			"   sleep               Enter low-power sleep mode.\n";
+	}
+};
+
+struct rtd_traits {
+	enum {
+		addr = 0x66,
+		bufsize = 32,
+		conv_us = 650000,         // Sleep min 600 milliseconds
+		quiet_us = 0,
+		cal_clear_us = 350000,    // Sleep min 300 milliseconds
+		has_read_all = 0
+	};
+
+	static const char *name() { return "rtd"; }
+	static const char *title() { return "RTD temperature"; }
+	static const char *print_format() { return "%.3f\n"; }
+
+	static const char *const *params() {
+		static const char *const p[] = { "T", NULL };
+		return p;
+	}
+
+	static const char *const *output_order() { return NULL; }
+
+	static const ezo_reg *regs() {
+		static const ezo_reg r[] = {
+			{ NULL, NULL }
+		};
+		return r;
+	}
+
+	static const ezo_read_op *read_ops() {
+		static const ezo_read_op r[] = {
+			{ "read", 0, 0 },
+			{ "read_avg", 0, 1 },
+			{ NULL, 0, 0 }
+		};
+		return r;
+	}
+
+	static const ezo_cal_op *cal_ops() {
+		static const ezo_cal_op c[] = {
+			{ "", "Cal", "%.2f", 650000 },           // Sleep min 600 milliseconds
+			{ NULL, NULL, NULL, 0 }
+		};
+		return c;
+	}
+
+	static double cal_stddev(double) { return 0.02; }
+
+	// Makes sure the circuit reports in Celsius
+	static int check_format(int dev) {
+		if(write_string("S,?", dev) != 0)
+			return 1;
+
+		usleep(350000); // Sleep min 300 milliseconds
+
+		std::string result;
+		if(read_string(result, dev, bufsize) != 0)
+			return 1;
+
+		if(result.find(",c") == std::string::npos) {
+			if(write_string("S,c", dev) != 0)
+				return 1;
+
+			usleep(350000); // Sleep min 300 milliseconds
+
+			if(read_string(result, dev, bufsize) != 0)
+				return 1;
+		}
+
+		return 0;
+	}
+
+	static const char *usage() {
+		return	"   read               Get a reading from the probe (Celsius)\n"
+			"   read --max-age <s> Reuse a reading at most s seconds old, if any\n"
+			"   read_avg <count>   Read count times and return average.\n"
+			"   info               Get device type and firmware version\n"
+			"   status             Get reason for previous restart, and voltage at VCC pin\n"
+			"   led get            Query LED status\n"
+			"   led set <on/off>   Turn LED on/off\n"
+			"   cal get            Get calibration status\n"
+			"   cal clear          Clear all calibration data\n"
+			"   cal <T>            Single point calibration at temperature T (Celsius)\n"
+			"   sleep              Enter low-power sleep mode.\n";
+	}
+};
+
+#endif
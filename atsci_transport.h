@@ -0,0 +1,591 @@
+#ifndef ATSCI_TRANSPORT_H
+#define ATSCI_TRANSPORT_H
+
+/*
+ * The bus calls under the transaction code. They go to the I2C device
+ * node, optionally recording every transfer to a transcript, or come from
+ * a transcript recorded earlier:
+ *
+ *   ATSCI_RECORD=<file>      Append every open, write and read to file
+ *   replay:<file>            Use as the device to play file back; reads
+ *                            are held until their recorded time, unless
+ *                            ATSCI_REPLAY_FAST is set
+ *
+ * A circuit in UART mode is used as uart:<tty>[:<baud>], like
+ * uart:/dev/ttyUSB0 (9600 baud by default). Each command goes out with a
+ * carriage return, and its reply lines are turned into what the circuit
+ * would have answered over I2C: the reply data, or an empty reply on *OK,
+ * behind status byte 1; status 2 on *ER, and 254 (pending) while no
+ * complete line has arrived. A circuit left in continuous mode would
+ * keep sending readings in between, so it is turned off (C,0) when the
+ * UART is opened, and the stream operation turns it back on. Still, the
+ * reply to a query is only the line that starts like it ("?STATUS," for
+ * STATUS, "?T," for T,? and so on), and a setting only gets *OK or *ER;
+ * other data lines are dropped. The replies are recorded like the I2C
+ * replies, behind the status byte, so a transcript of a UART plays back
+ * like any other.
+ *
+ * A circuit behind a TCA9548A style I2C multiplexer is reached by
+ * appending the mux address and channel to the device, like
+ * /dev/i2c-1@0x70:3. The channel is switched only when the last
+ * transaction through that mux was on another one; with replay: the mux is
+ * simulated.
+ *
+ * A transcript has one transfer per line:
+ *
+ *   <microseconds since open> <o|w|r> <[mux:channel:]address> <bytes in hex>
+ *
+ * with the bytes of a read as they came from the bus, before the high
+ * bits are masked off.
+ */
+
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+
+// Where the bus calls report errors; callers that must not block on
+// stderr point this elsewhere
+inline std::ostream *&bus_errors() {
+	static std::ostream *stream = &std::cerr;
+	return stream;
+}
+
+// perror() on bus_errors()
+inline void bus_perror(const char *what) {
+	int err = errno;
+	*bus_errors() << what << ": " << strerror(err) << std::endl;
+}
+
+struct transcript_op {
+	long t_us;
+	char op;
+	std::string data;
+};
+
+struct transcript {
+	double t0;          // When the transcript started, on this run's clock
+	std::map<std::string, std::deque<transcript_op> > ops;  // By address
+};
+
+// The mux channel a device is behind
+struct mux_route {
+	std::string node;   // Device node, or replay:<file>
+	int mux;
+	int channel;
+};
+
+struct uart_dev {
+	std::string in;      // Unframed input
+	std::string expect;  // Start of the reply to the last command; "" for *OK, "R" for a reading
+};
+
+struct replay_dev {
+	std::deque<transcript_op> *ops;  // The transfers of this address
+	double t0;
+};
+
+struct transport_state {
+	bool init;
+	FILE *record;
+	double t0;
+	std::map<int, std::string> addrs;                              // fd -> address
+	std::map<std::string, transcript> transcripts;
+	std::map<int, replay_dev> replays;                             // fd -> replay
+	std::map<int, mux_route> routes;                               // fd -> mux channel
+	std::map<std::string, int> mux_fds;                            // node@mux -> fd
+	std::map<std::string, int> mux_channels;                       // node@mux -> channel
+	std::map<int, uart_dev> uarts;                                 // fd -> UART
+	long mux_switches;
+};
+
+inline double transport_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+inline transport_state &transport() {
+	static transport_state state;
+
+	if(!state.init) {
+		state.init = true;
+		state.record = NULL;
+		state.mux_switches = 0;
+		state.t0 = transport_clock();
+
+		const char *path = getenv("ATSCI_RECORD");
+		if(path && *path && !(state.record = fopen(path, "a")))
+			bus_perror("ATSCI_RECORD");
+	}
+
+	return state;
+}
+
+inline void transport_record(int dev, char op, const char *data, size_t len) {
+	transport_state &t = transport();
+	if(!t.record)
+		return;
+
+	fprintf(t.record, "%ld %c %s ", (long)((transport_clock() - t.t0) * 1e6), op, t.addrs[dev].c_str());
+	for(size_t i=0; i<len; i++)
+		fprintf(t.record, "%02x", (unsigned char)data[i]);
+
+	fprintf(t.record, "\n");
+	fflush(t.record);
+}
+
+// Loads a transcript, which starts playing now
+inline transcript *transcript_load(const std::string &path) {
+	transport_state &t = transport();
+
+	if(t.transcripts.count(path))
+		return &t.transcripts[path];
+
+	FILE *f = fopen(path.c_str(), "r");
+	if(!f) {
+		bus_perror("fopen");
+		*bus_errors() << "Unable to open the transcript " << path << "." << std::endl;
+		return NULL;
+	}
+
+	transcript &tr = t.transcripts[path];
+	char line[512], hex[300];
+	long first = -1;
+
+	while(fgets(line, sizeof(line), f)) {
+		transcript_op op;
+		char addr[32];
+		hex[0] = '\0';
+
+		if(sscanf(line, "%ld %c %31s %299s", &op.t_us, &op.op, addr, hex) < 3)
+			continue;
+
+		for(size_t i=0; hex[i] && hex[i+1]; i+=2) {
+			unsigned int byte;
+			sscanf(hex + i, "%2x", &byte);
+			op.data += (char)byte;
+		}
+
+		if(first < 0) first = op.t_us;
+		tr.ops[addr].push_back(op);
+	}
+
+	fclose(f);
+	tr.t0 = transport_clock() - (first > 0 ? first / 1e6 : 0);
+	return &tr;
+}
+
+// Opens the device node and selects addr on it
+inline int node_open(const std::string &node, int addr) {
+	int dev = open(node.c_str(), O_RDWR);
+	if(dev < 0) {
+		bus_perror("open");
+		return -1;
+	}
+
+	if(ioctl(dev, I2C_SLAVE, addr) < 0) {
+		bus_perror("ioctl");
+		close(dev);
+		errno = ENXIO;
+		return -1;
+	}
+
+	return dev;
+}
+
+inline speed_t uart_speed(int baud) {
+	switch(baud) {
+		case 300: return B300;
+		case 1200: return B1200;
+		case 2400: return B2400;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+	}
+
+	return B0;
+}
+
+// Opens "<tty>[:<baud>]" raw and non-blocking
+inline int uart_open(const std::string &spec) {
+	std::string tty = spec;
+	int baud = 9600;
+
+	size_t colon = spec.rfind(':');
+	if(colon != std::string::npos && sscanf(spec.c_str() + colon + 1, "%d", &baud) == 1)
+		tty = spec.substr(0, colon);
+
+	if(uart_speed(baud) == B0) {
+		*bus_errors() << "Unsupported baud rate: " << baud << std::endl;
+		errno = EINVAL;
+		return -1;
+	}
+
+	int dev = open(tty.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(dev < 0) {
+		bus_perror("open");
+		return -1;
+	}
+
+	struct termios tio;
+	if(tcgetattr(dev, &tio) != 0) {
+		bus_perror("tcgetattr");
+		close(dev);
+		return -1;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, uart_speed(baud));
+	cfsetospeed(&tio, uart_speed(baud));
+
+	if(tcsetattr(dev, TCSANOW, &tio) != 0) {
+		bus_perror("tcsetattr");
+		close(dev);
+		return -1;
+	}
+
+	return dev;
+}
+
+/*
+ * Takes the next complete line the circuit sent, waiting at most
+ * timeout_ms for it. Returns 0 with a line, 1 if there was none.
+ */
+inline int uart_take_line(int dev, std::string &line, int timeout_ms) {
+	std::string &in = transport().uarts[dev].in;
+
+	for(;;) {
+		size_t end = in.find_first_of("\r\n");
+		if(end != std::string::npos) {
+			line = in.substr(0, end);
+			in.erase(0, end + 1);
+
+			if(line.empty())
+				continue;
+
+			return 0;
+		}
+
+		struct pollfd pfd = { dev, POLLIN, 0 };
+		int ready = poll(&pfd, 1, timeout_ms);
+		if(ready < 0 && errno == EINTR)
+			return 1;
+
+		if(ready <= 0)
+			return 1;
+
+		char buf[64];
+		ssize_t n = read(dev, buf, sizeof(buf));
+		if(n <= 0)
+			return 1;
+
+		in.append(buf, n);
+	}
+}
+
+inline ssize_t bus_read(int dev, char *buf, size_t len);
+
+// The next reading line of continuous mode, skipping the * messages
+inline int uart_line(int dev, std::string &line, int timeout_ms) {
+	// A recording of one has them as replies
+	if(transport().replays.count(dev)) {
+		char buf[64];
+		ssize_t n = bus_read(dev, buf, sizeof(buf));
+		if(n < 2 || buf[0] != 1)
+			return 1;
+
+		line.assign(buf + 1, n - 1);
+		return 0;
+	}
+
+	while(uart_take_line(dev, line, timeout_ms) == 0)
+		if(line[0] != '*') {
+			std::string reply = std::string(1, 1) + line;
+			transport_record(dev, 'r', reply.data(), reply.size());
+			return 0;
+		}
+
+	return 1;
+}
+
+// What the reply to cmd starts with; see uart_dev
+inline std::string uart_expect(const std::string &cmd) {
+	std::string name = cmd;
+	if(name.size() > 2 && name.compare(name.size() - 2, 2, ",?") == 0)
+		name.erase(name.size() - 2);
+
+	else if(strcasecmp(name.c_str(), "STATUS") != 0 && strcasecmp(name.c_str(), "I") != 0)
+		return (strcasecmp(name.c_str(), "R") == 0) ? "R" : "";
+
+	for(size_t i=0; i<name.size(); i++)
+		name[i] = toupper((unsigned char)name[i]);
+
+	return "?" + name + ",";
+}
+
+// Whether line is the reply to the command u is waiting for
+inline bool uart_reply(const uart_dev &u, const std::string &line) {
+	if(u.expect == "R")
+		return line[0] != '?';
+
+	return !u.expect.empty() && strncasecmp(line.c_str(), u.expect.c_str(), u.expect.size()) == 0;
+}
+
+// Splits "<node>@<mux>:<channel>"; mux is -1 without one
+inline int parse_mux(const std::string &bus, std::string &node, int *mux, int *channel) {
+	size_t at = bus.rfind('@');
+	node = bus;
+	*mux = *channel = -1;
+
+	if(at == std::string::npos)
+		return 0;
+
+	node = bus.substr(0, at);
+	if(sscanf(bus.c_str() + at + 1, "%i:%i", mux, channel) != 2 || *mux < 0x01 || *mux > 0x7F ||
+	   *channel < 0 || *channel > 7) {
+		*bus_errors() << "Invalid multiplexer channel: " << bus.substr(at) << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Switches the mux in front of dev to its channel, if it is not there
+inline int mux_select(int dev) {
+	transport_state &t = transport();
+	std::map<int, mux_route>::iterator route = t.routes.find(dev);
+	if(route == t.routes.end())
+		return 0;
+
+	const mux_route &m = route->second;
+	char key[16];
+	snprintf(key, sizeof(key), "@%02x", m.mux);
+	std::string mux_key = m.node + key;
+
+	if(t.mux_channels.count(mux_key) && t.mux_channels[mux_key] == m.channel)
+		return 0;
+
+	t.mux_switches++;
+
+	if(m.node.compare(0, 7, "replay:") == 0) {
+		t.mux_channels[mux_key] = m.channel;
+		return 0;
+	}
+
+	if(!t.mux_fds.count(mux_key)) {
+		int fd = node_open(m.node, m.mux);
+		if(fd < 0)
+			return -1;
+
+		t.mux_fds[mux_key] = fd;
+		snprintf(key, sizeof(key), "%02x", m.mux);
+		t.addrs[fd] = key;
+	}
+
+	int fd = t.mux_fds[mux_key];
+	char select = 1 << m.channel;
+
+	if(write(fd, &select, 1) != 1) {
+		bus_perror("write");
+		*bus_errors() << "Unable to select multiplexer channel " << m.channel << "." << std::endl;
+		t.mux_channels.erase(mux_key);
+		return -1;
+	}
+
+	transport_record(fd, 'w', &select, 1);
+	t.mux_channels[mux_key] = m.channel;
+	return 0;
+}
+
+// Opens the bus and selects the circuit at addr, like open() and ioctl()
+inline int bus_open(const std::string &bus, int addr) {
+	transport_state &t = transport();
+
+	std::string node;
+	int mux, channel;
+	if(parse_mux(bus, node, &mux, &channel) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	char key[16];
+	if(mux < 0) snprintf(key, sizeof(key), "%02x", addr);
+	else snprintf(key, sizeof(key), "%02x:%d:%02x", mux, channel, addr);
+
+	int dev;
+
+	if(node.compare(0, 5, "uart:") == 0) {
+		dev = uart_open(node.substr(5));
+		if(dev < 0)
+			return -1;
+
+		t.uarts[dev] = uart_dev();
+		t.replays.erase(dev);
+
+		// Stop continuous mode, or a reading could come in for the
+		// answer to R
+		std::string line;
+		if(write(dev, "C,0\r", 4) == 4)
+			while(uart_take_line(dev, line, 350) == 0 && line != "*OK" && line != "*ER");
+	}
+
+	else if(node.compare(0, 7, "replay:") == 0) {
+		transcript *tr = transcript_load(node.substr(7));
+		if(!tr)
+			return -1;
+
+		// A real descriptor, so it can be closed like any other
+		dev = open("/dev/null", O_RDWR);
+		if(dev < 0)
+			return -1;
+
+		replay_dev r = { &tr->ops[key], tr->t0 };
+		t.replays[dev] = r;
+		t.uarts.erase(dev);
+	}
+
+	else {
+		dev = node_open(node, addr);
+		if(dev < 0)
+			return -1;
+
+		t.replays.erase(dev);
+		t.uarts.erase(dev);
+	}
+
+	t.addrs[dev] = key;
+	t.routes.erase(dev);
+
+	if(mux >= 0) {
+		mux_route m = { node, mux, channel };
+		t.routes[dev] = m;
+	}
+
+	transport_record(dev, 'o', "", 0);
+	return dev;
+}
+
+inline ssize_t bus_write(int dev, const char *buf, size_t len) {
+	transport_state &t = transport();
+	std::map<int, replay_dev>::iterator r = t.replays.find(dev);
+
+	if(mux_select(dev) != 0)
+		return -1;
+
+	if(t.uarts.count(dev)) {
+		// Whatever is left is from before this command
+		tcflush(dev, TCIFLUSH);
+		t.uarts[dev].in = "";
+		t.uarts[dev].expect = uart_expect(std::string(buf, len));
+
+		std::string cmd = std::string(buf, len) + "\r";
+		if(write(dev, cmd.data(), cmd.size()) != (ssize_t)cmd.size())
+			return -1;
+
+		transport_record(dev, 'w', buf, len);
+		return len;
+	}
+
+	if(r == t.replays.end()) {
+		ssize_t n = write(dev, buf, len);
+		if(n > 0) transport_record(dev, 'w', buf, n);
+		return n;
+	}
+
+	// Skip ahead to the same write, in case this run left some out
+	std::deque<transcript_op> &ops = *r->second.ops;
+	std::string data(buf, len);
+	size_t next = 0, skipped = 0;
+
+	for(; next < ops.size() && !(ops[next].op == 'w' && ops[next].data == data); next++)
+		if(ops[next].op != 'o') skipped++;
+
+	if(next == ops.size()) {
+		*bus_errors() << "Replay: write " << data << " not in the transcript." << std::endl;
+		errno = EIO;
+		return -1;
+	}
+
+	if(skipped > 0)
+		*bus_errors() << "Replay: skipped " << skipped << " transfers to write " << data << "." << std::endl;
+
+	ops.erase(ops.begin(), ops.begin() + next + 1);
+	return len;
+}
+
+inline ssize_t bus_read(int dev, char *buf, size_t len) {
+	transport_state &t = transport();
+	std::map<int, replay_dev>::iterator r = t.replays.find(dev);
+
+	if(mux_select(dev) != 0)
+		return -1;
+
+	if(t.uarts.count(dev)) {
+		const uart_dev &u = t.uarts[dev];
+		std::string line, reply(1, (char)254);
+
+		// A little wait for the rest of a reply that is on its way. Other
+		// data lines are readings of continuous mode, and are dropped.
+		while(uart_take_line(dev, line, 50) == 0) {
+			if(line == "*ER") { reply = std::string(1, 2); break; }
+			if(line == "*OK") { reply = std::string(1, 1); break; }
+			if(line[0] != '*' && uart_reply(u, line)) { reply = std::string(1, 1) + line; break; }
+		}
+
+		transport_record(dev, 'r', reply.data(), reply.size());
+
+		size_t n = (reply.size() < len) ? reply.size() : len;
+		memcpy(buf, reply.data(), n);
+		return n;
+	}
+
+	if(r == t.replays.end()) {
+		ssize_t n = read(dev, buf, len);
+		if(n > 0) transport_record(dev, 'r', buf, n);
+		return n;
+	}
+
+	std::deque<transcript_op> &ops = *r->second.ops;
+	while(!ops.empty() && ops.front().op == 'o')
+		ops.pop_front();
+
+	if(ops.empty() || ops.front().op != 'r') {
+		errno = EIO;
+		return -1;
+	}
+
+	transcript_op op = ops.front();
+	ops.pop_front();
+
+	if(!getenv("ATSCI_REPLAY_FAST")) {
+		double left = r->second.t0 + op.t_us / 1e6 - transport_clock();
+		if(left > 0)
+			usleep((useconds_t)(left * 1e6));
+	}
+
+	size_t n = (op.data.size() < len) ? op.data.size() : len;
+	memcpy(buf, op.data.data(), n);
+	return n;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Conversions of ezo_async on one bus: pH and DO run in parallel, EC on
+ * its own after them, and the next pH only after the quiet period of the
+ * EC. Deleting a device with a conversion in flight or a read waiting for
+ * the bus leaves the others running. The readings are cached by the file
+ * writer of the loop, on disk once the loop is gone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "atsci_async.h"
+
+struct result {
+	const char *name;
+	int status;
+	double end;    // Seconds from the start
+};
+
+static double t0;
+
+static void on_reading(void *arg, int status, const std::vector<float> &) {
+	result *r = static_cast<result *>(arg);
+	r->status = status;
+	r->end = state_now() - t0;
+}
+
+static int check(const result &r, double from, double to) {
+	if(r.status == 0 && r.end >= from && r.end <= to)
+		return 0;
+
+	printf("async: %s ended at %.3f s with status %d, expected %.2f to %.2f s\n", r.name, r.end, r.status, from, to);
+	return 1;
+}
+
+int main() {
+	char dir[] = "/tmp/atsci-async.XXXXXX";
+	if(!mkdtemp(dir))
+		return 1;
+
+	setenv("ATSCI_STATE_DIR", dir, 1);
+	setenv("ATSCI_REPLAY_FAST", "1", 1);
+
+	const char *bus = "replay:tests/async.log";
+	std::vector<std::string> ph_names(1, "pH"), do_names(1, "DO"), ec_names(1, "EC");
+	result ph1 = { "pH", -1, 0 }, ph2 = { "second pH", -1, 0 }, dox = { "DO", -1, 0 }, ec = { "EC", -1, 0 };
+
+	{
+		ezo_loop loop;
+		ezo_async<ph_traits> ph(loop, bus);
+		ezo_async<do_traits> dos(loop, bus);
+		ezo_async<ec_traits> ecs(loop, bus);
+		ezo_async<do_traits> *converting = new ezo_async<do_traits>(loop, bus, 0x62);
+		ezo_async<ec_traits> *waiting = new ezo_async<ec_traits>(loop, bus, 0x65);
+
+		if(ph.open() || dos.open() || ecs.open() || converting->open() || waiting->open())
+			return 1;
+
+		t0 = state_now();
+		ph.read(ph_names, on_reading, &ph1);
+		dos.read(do_names, on_reading, &dox);
+		converting->read(do_names, on_reading, NULL);
+		ecs.read(ec_names, on_reading, &ec);
+		waiting->read(ec_names, on_reading, NULL);
+		ph.read(ph_names, on_reading, &ph2);
+
+		delete converting;
+		delete waiting;
+
+		loop.run();
+	}
+
+	int failed = check(ph1, 1.0, 1.3) + check(dox, 1.0, 1.3) + check(ec, 2.05, 2.5) + check(ph2, 4.6, 5.1);
+
+	std::string cached;
+	float value = 0;
+	if(state_read(bus, 0x63, "cache-pH", cached) != 0 || sscanf(cached.c_str(), "%f", &value) != 1 || value != 7.03f) {
+		printf("async: the second pH is not in the cache: %s\n", cached.c_str());
+		failed++;
+	}
+
+	std::string cmd = std::string("rm -rf ") + dir;
+	if(system(cmd.c_str()) != 0)
+		failed++;
+
+	if(!failed)
+		printf("async: ok\n");
+
+	return failed != 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * A stand-in for an EZO circuit in UART mode, on a pty:
+ *
+ *    tests/ezopty <log> <program> [arguments ...]
+ *
+ * runs the program with every TTY in its arguments replaced by the slave
+ * side of the pty, answers its commands on the master side, and writes
+ * each command it got to log, a line each. Exits like the program.
+ *
+ * Like a circuit fresh from power-up it starts in continuous mode,
+ * sending 7.01, 7.02, ... every 200 ms until C,0. With C,1 the readings
+ * start over from 7.01. R is answered with 7.05, and every Cal command
+ * fails with *ER. Any other command first gets a stray 9.99, as if a
+ * reading of continuous mode had crossed it, and then its reply.
+ */
+
+#include <string>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define EZOPTY_STREAM_US 200000
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send(int fd, const std::string &s) {
+	if(write(fd, s.data(), s.size()) != (ssize_t)s.size())
+		perror("ezopty: write");
+}
+
+static std::string reply(const std::string &cmd, bool *continuous, int *next) {
+	if(cmd == "C,0" || cmd == "C,1") {
+		*continuous = (cmd == "C,1");
+		*next = 1;
+		return "*OK\r";
+	}
+
+	if(strcasecmp(cmd.c_str(), "R") == 0)
+		return "7.05\r*OK\r";
+
+	if(strncasecmp(cmd.c_str(), "Cal,", 4) == 0)
+		return "*ER\r";
+
+	std::string stray = "9.99\r";
+
+	if(strcasecmp(cmd.c_str(), "T,?") == 0)
+		return stray + "?T,21.50\r*OK\r";
+
+	if(strcasecmp(cmd.c_str(), "STATUS") == 0)
+		return stray + "?STATUS,P,5.038\r*OK\r";
+
+	if(strcasecmp(cmd.c_str(), "I") == 0)
+		return stray + "?I,pH,2.10\r*OK\r";
+
+	return stray + "*OK\r";
+}
+
+int main(int argc, char **argv) {
+	if(argc < 3) {
+		fprintf(stderr, "Usage: ezopty <log> <program> [arguments ...]\n");
+		return 2;
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("ezopty: posix_openpt");
+		return 2;
+	}
+
+	std::string tty = ptsname(master);
+
+	// Raw from the start, so nothing sent before the program sets up the
+	// line is echoed back as a command. Held open, so the master never
+	// sees a hangup in between.
+	int slave = open(tty.c_str(), O_RDWR | O_NOCTTY);
+	struct termios tio;
+	if(slave < 0 || tcgetattr(slave, &tio) != 0) {
+		perror("ezopty: open");
+		return 2;
+	}
+
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	FILE *log = fopen(argv[1], "w");
+	if(!log) {
+		perror(argv[1]);
+		return 2;
+	}
+
+	pid_t pid = fork();
+	if(pid < 0) {
+		perror("ezopty: fork");
+		return 2;
+	}
+
+	if(pid == 0) {
+		close(master);
+		close(slave);
+
+		for(int i=2; i<argc; i++) {
+			std::string arg = argv[i];
+			size_t at = arg.find("TTY");
+			if(at != std::string::npos)
+				argv[i] = strdup(arg.replace(at, 3, tty).c_str());
+		}
+
+		execv(argv[2], argv + 2);
+		perror(argv[2]);
+		_exit(127);
+	}
+
+	bool continuous = true;
+	int next = 1;
+	double streamed = 0;
+	std::string in;
+
+	for(;;) {
+		int status;
+		if(waitpid(pid, &status, WNOHANG) == pid) {
+			fclose(log);
+			return WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+		}
+
+		if(continuous && now() - streamed >= EZOPTY_STREAM_US / 1e6) {
+			char line[16];
+			snprintf(line, sizeof(line), "7.%02d\r", next++);
+			send(master, line);
+			streamed = now();
+		}
+
+		struct pollfd pfd = { master, POLLIN, 0 };
+		if(poll(&pfd, 1, 20) <= 0)
+			continue;
+
+		char buf[64];
+		ssize_t n = read(master, buf, sizeof(buf));
+		if(n <= 0)
+			continue;
+
+		in.append(buf, n);
+
+		size_t end;
+		while((end = in.find('\r')) != std::string::npos) {
+			std::string cmd = in.substr(0, end);
+			in.erase(0, end + 1);
+
+			fprintf(log, "%s\n", cmd.c_str());
+			fflush(log);
+
+			send(master, reply(cmd, &continuous, &next));
+		}
+	}
+}
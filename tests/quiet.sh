@@ -0,0 +1,36 @@
+#!/bin/sh
+# An EC reading holds off the next measurement on the bus, also when the
+# two are taken by separate invocations of the tools, and also when the
+# circuits are behind different channels of a multiplexer.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+export ATSCI_STATE_DIR="$dir" ATSCI_REPLAY_FAST=1
+
+# quiet <EC bus> <pH bus>
+quiet() {
+	rm -f "$dir"/*
+
+	./atsci_ec $1 read > /dev/null || exit 1
+	end=$(date +%s.%N)
+
+	if ! ls "$dir"/*-00-quiet > /dev/null 2>&1; then
+		echo "quiet: atsci_ec left no quiet period for $1"
+		exit 1
+	fi
+
+	./atsci_ph $2 read > /dev/null || exit 1
+	took=$(echo "$(date +%s.%N) $end" | awk '{ print $1 - $2 }')
+
+	# The pH conversion takes 1.05 s, and has to wait out most of the 1.5 s
+	if awk "BEGIN { exit !($took < 2.3) }"; then
+		echo "quiet: atsci_ph on $2 did not wait for the quiet period ($took s)"
+		exit 1
+	fi
+}
+
+quiet replay:tests/bus.log replay:tests/bus.log
+quiet replay:tests/mux.log@0x70:1 replay:tests/mux.log@0x70:2
+
+echo "quiet: ok"
@@ -0,0 +1,50 @@
+#!/bin/sh
+# A recording of a circuit in UART mode plays back like one over I2C, the
+# readings of continuous mode included. Then the same against a live
+# stand-in on a pty (tests/ezopty): continuous mode is turned off at open,
+# readings crossing a reply are dropped, and *OK and *ER come through as
+# success and failure.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+export ATSCI_STATE_DIR="$dir" ATSCI_REPLAY_FAST=1
+
+out=$(./atsci_ph replay:tests/uart.log stream 2) || exit 1
+
+if [ "$out" != "$(printf '7.01\n7.02')" ]; then
+	echo "uart: unexpected stream from the recording: $out"
+	exit 1
+fi
+
+# expect <output> <commands> <operation ...>
+expect() {
+	want=$1 cmds=$2
+	shift 2
+
+	out=$(tests/ezopty "$dir/commands" ./atsci_ph uart:TTY "$@")
+	status=$?
+
+	if [ $status -ne 0 ] || [ "$out" != "$want" ]; then
+		echo "uart: $* on the pty gave \"$out\" (status $status), expected \"$want\""
+		exit 1
+	fi
+
+	if [ "$(tr '\n' ' ' < "$dir/commands")" != "$cmds " ]; then
+		echo "uart: $* on the pty sent $(tr '\n' ' ' < "$dir/commands"), expected $cmds"
+		exit 1
+	fi
+}
+
+expect 7.05 "C,0 R" read
+expect 21.5 "C,0 T,?" temp get
+expect "Last restart reason: power on reset, voltage at VCC pin: 5.038" "C,0 STATUS" status
+expect "" "C,0 T,25 STATUS" temp set 25 --tolerance -1
+expect "$(printf '7.01\n7.02')" "C,0 C,1 C,0" stream 2
+
+if tests/ezopty "$dir/commands" ./atsci_ph uart:TTY cal mid 7.00 > /dev/null; then
+	echo "uart: a calibration answered with *ER did not fail"
+	exit 1
+fi
+
+echo "uart: ok"